@@ -0,0 +1,190 @@
+#include "acpi.h"
+#include "paging.h"
+#include <stddef.h>
+
+#define EBDA_SEGMENT_PTR 0x40E
+#define BIOS_ROM_START   0xE0000
+#define BIOS_ROM_SIZE    0x20000
+
+#define MADT_LAPIC  0
+#define MADT_IOAPIC 1
+#define MADT_ISO    2
+
+#define MADT_LAPIC_ENABLED 0x1
+
+struct rsdp {
+    char signature[8];          // "RSD PTR "
+    uint8_t checksum;           // over these first 20 bytes
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_addr;
+} __attribute__((packed));
+
+struct madt {
+    struct acpi_sdt_header header;
+    uint32_t lapic_addr;
+    uint32_t flags;
+} __attribute__((packed));
+
+struct madt_entry {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+
+struct madt_lapic {
+    struct madt_entry entry;
+    uint8_t acpi_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} __attribute__((packed));
+
+struct madt_ioapic {
+    struct madt_entry entry;
+    uint8_t id;
+    uint8_t reserved;
+    uint32_t addr;
+    uint32_t gsi_base;
+} __attribute__((packed));
+
+struct madt_iso {
+    struct madt_entry entry;
+    uint8_t bus;
+    uint8_t irq;
+    uint32_t gsi;
+    uint16_t flags;
+} __attribute__((packed));
+
+static int sig_equal(const char *a, const char *b, int n) {
+    int i;
+    for (i = 0; i < n; i++) {
+        if (a[i] != b[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// ACPI structures are valid when all their bytes sum to zero
+static uint8_t checksum(const void *p, uint32_t len) {
+    const uint8_t *b = p;
+    uint8_t sum = 0;
+    uint32_t i;
+    for (i = 0; i < len; i++) {
+        sum += b[i];
+    }
+    return sum;
+}
+
+// The RSDP sits on a 16-byte boundary in the first KiB of the EBDA or
+// in the BIOS ROM area
+static struct rsdp *rsdp_scan(uint32_t start, uint32_t len) {
+    uint32_t addr;
+    for (addr = start; addr + sizeof(struct rsdp) <= start + len; addr += 16) {
+        if (sig_equal((const char*)addr, "RSD PTR ", 8) && checksum((void*)addr, 20) == 0) {
+            return (struct rsdp*)addr;
+        }
+    }
+    return NULL;
+}
+
+static struct rsdp *rsdp_find(void) {
+    uint32_t ebda = (uint32_t)*(volatile uint16_t*)EBDA_SEGMENT_PTR << 4;
+    struct rsdp *r = NULL;
+    if (ebda != 0) {
+        r = rsdp_scan(ebda, 1024);
+    }
+    if (r == NULL) {
+        r = rsdp_scan(BIOS_ROM_START, BIOS_ROM_SIZE);
+    }
+    return r;
+}
+
+// Tables usually live just past the end of usable RAM, which the boot
+// identity map may not cover
+static struct acpi_sdt_header *acpi_map(uint32_t addr) {
+    struct acpi_sdt_header *h = (struct acpi_sdt_header*)addr;
+    if (map_identity(addr, sizeof(struct acpi_sdt_header), PTE_WRITABLE) != 0 ||
+        map_identity(addr, h->length, PTE_WRITABLE) != 0 ||
+        checksum(h, h->length) != 0) {
+        return NULL;
+    }
+    return h;
+}
+
+struct acpi_sdt_header *acpi_find_table(const char *signature) {
+    struct rsdp *r = rsdp_find();
+    struct acpi_sdt_header *rsdt;
+    struct acpi_sdt_header *h;
+    uint32_t *entries;
+    uint32_t i;
+
+    if (r == NULL || (rsdt = acpi_map(r->rsdt_addr)) == NULL) {
+        return NULL;
+    }
+    entries = (uint32_t*)(rsdt + 1);
+    for (i = 0; i < (rsdt->length - sizeof(struct acpi_sdt_header)) / 4; i++) {
+        h = acpi_map(entries[i]);
+        if (h != NULL && sig_equal(h->signature, signature, 4)) {
+            return h;
+        }
+    }
+    return NULL;
+}
+
+int acpi_parse_madt(struct madt_info *out) {
+    struct madt *m = (struct madt*)acpi_find_table("APIC");
+    struct madt_entry *e;
+    struct madt_lapic *la;
+    struct madt_ioapic *io;
+    struct madt_iso *iso;
+    uint8_t *p;
+    uint8_t *end;
+    int i;
+
+    if (m == NULL) {
+        return -1;
+    }
+    out->lapic_addr = m->lapic_addr;
+    out->num_lapics = 0;
+    out->ioapic_addr = 0;
+    out->ioapic_gsi_base = 0;
+    // ISA IRQs map one to one, edge triggered and active high, unless
+    // an override says otherwise
+    for (i = 0; i < ACPI_ISA_IRQS; i++) {
+        out->irq_gsi[i] = i;
+        out->irq_flags[i] = 0;
+    }
+
+    p = (uint8_t*)(m + 1);
+    end = (uint8_t*)m + m->header.length;
+    while (p + sizeof(struct madt_entry) <= end) {
+        e = (struct madt_entry*)p;
+        if (e->length < sizeof(struct madt_entry) || p + e->length > end) {
+            break;
+        }
+        switch (e->type) {
+        case MADT_LAPIC:
+            la = (struct madt_lapic*)e;
+            if ((la->flags & MADT_LAPIC_ENABLED) && out->num_lapics < MAX_CPUS) {
+                out->lapic_ids[out->num_lapics++] = la->apic_id;
+            }
+            break;
+        case MADT_IOAPIC:
+            io = (struct madt_ioapic*)e;
+            if (out->ioapic_addr == 0) {
+                out->ioapic_addr = io->addr;
+                out->ioapic_gsi_base = io->gsi_base;
+            }
+            break;
+        case MADT_ISO:
+            iso = (struct madt_iso*)e;
+            if (iso->bus == 0 && iso->irq < ACPI_ISA_IRQS) {
+                out->irq_gsi[iso->irq] = iso->gsi;
+                out->irq_flags[iso->irq] = iso->flags;
+            }
+            break;
+        }
+        p += e->length;
+    }
+    return 0;
+}
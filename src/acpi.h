@@ -0,0 +1,43 @@
+#ifndef __ACPI_H__
+#define __ACPI_H__
+
+#include <stdint.h>
+#include "cpu.h"
+
+#define ACPI_ISA_IRQS 16
+
+struct acpi_sdt_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+// What the kernel takes from the MADT. Only the first I/O APIC is kept.
+struct madt_info {
+    uint32_t lapic_addr;
+    unsigned int num_lapics;
+    uint8_t lapic_ids[MAX_CPUS];        // enabled processors, in table order
+    uint32_t ioapic_addr;               // 0 if there is none
+    uint32_t ioapic_gsi_base;
+    uint32_t irq_gsi[ACPI_ISA_IRQS];    // ISA IRQ to global system interrupt
+    uint16_t irq_flags[ACPI_ISA_IRQS];  // MPS INTI polarity and trigger bits
+};
+
+// MPS INTI flags from interrupt source overrides
+#define MPS_POLARITY_MASK 0x3
+#define MPS_POLARITY_LOW  0x3
+#define MPS_TRIGGER_MASK  0xC
+#define MPS_TRIGGER_LEVEL 0xC
+
+// Find a table through the RSDP and RSDT, mapping it if needed.
+// @return the table, or NULL if it is missing or fails its checksum
+struct acpi_sdt_header *acpi_find_table(const char *signature);
+int acpi_parse_madt(struct madt_info *out);
+
+#endif
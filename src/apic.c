@@ -0,0 +1,147 @@
+#include "apic.h"
+#include "acpi.h"
+#include "cpu.h"
+#include "interrupt.h"
+#include "paging.h"
+#include "page.h"
+#include "spinlock.h"
+#include <stddef.h>
+
+volatile uint32_t *lapic = NULL;
+uint8_t apic_cpu[256];
+
+static volatile uint32_t *ioapic = NULL;
+static uint32_t ioapic_pins;
+static spinlock_t ioapic_lock = SPINLOCK_INIT;
+static struct madt_info madt;
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+static uint32_t ioapic_read(uint32_t reg) {
+    ioapic[IOAPIC_REGSEL / 4] = reg;
+    return ioapic[IOAPIC_WIN / 4];
+}
+
+static void ioapic_write(uint32_t reg, uint32_t value) {
+    ioapic[IOAPIC_REGSEL / 4] = reg;
+    ioapic[IOAPIC_WIN / 4] = value;
+}
+
+void lapic_init(void) {
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | SPURIOUS_VECTOR);
+    // Only the boot CPU may take the 8259's virtual-wire interrupts
+    if (cpu_id() != 0) {
+        lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+    }
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+void lapic_send_ipi(uint8_t apic_id, uint32_t icr) {
+    uint32_t flags = irq_save();
+    while (lapic_read(LAPIC_ICR_LO) & ICR_PENDING) {
+        asm volatile("pause");
+    }
+    lapic_write(LAPIC_ICR_HI, (uint32_t)apic_id << 24);
+    lapic_write(LAPIC_ICR_LO, icr);
+    while (lapic_read(LAPIC_ICR_LO) & ICR_PENDING) {
+        asm volatile("pause");
+    }
+    irq_restore(flags);
+}
+
+int ioapic_enabled(void) {
+    return ioapic != NULL;
+}
+
+static void ioapic_route(uint8_t irq, int masked) {
+    uint32_t pin = madt.irq_gsi[irq] - madt.ioapic_gsi_base;
+    uint32_t entry = IOAPIC_REDTBL + 2 * pin;
+    uint32_t low = IRQ_VECTOR_BASE + irq;
+    if (madt.irq_gsi[irq] < madt.ioapic_gsi_base || pin >= ioapic_pins) {
+        return;     // wired to some other I/O APIC
+    }
+    if ((madt.irq_flags[irq] & MPS_POLARITY_MASK) == MPS_POLARITY_LOW) {
+        low |= IOAPIC_POLARITY_LOW;
+    }
+    if ((madt.irq_flags[irq] & MPS_TRIGGER_MASK) == MPS_TRIGGER_LEVEL) {
+        low |= IOAPIC_LEVEL;
+    }
+    if (masked) {
+        low |= IOAPIC_MASKED;
+    }
+    // Device interrupts all go to the boot CPU
+    ioapic_write(entry + 1, (uint32_t)cpus[0].apic_id << 24);
+    ioapic_write(entry, low);
+}
+
+void ioapic_set_mask(uint8_t irq, int masked) {
+    uint32_t flags;
+    // IRQ 2 is the PIC cascade; its pin usually carries the PIT instead
+    if (ioapic == NULL || irq >= ACPI_ISA_IRQS || irq == 2) {
+        return;
+    }
+    flags = spin_lock_irqsave(&ioapic_lock);
+    ioapic_route(irq, masked);
+    spin_unlock_irqrestore(&ioapic_lock, flags);
+}
+
+// Take over the ISA IRQs with the masks the 8259s have now, then shut
+// the 8259s off
+static void ioapic_init(void) {
+    uint16_t pic_mask = inb(PIC_1_DATA) | (inb(PIC_2_DATA) << 8);
+    uint32_t i;
+
+    if (map_identity(madt.ioapic_addr, PAGE_SIZE, PTE_WRITABLE | PTE_PCD | PTE_PWT) != 0) {
+        return;
+    }
+    ioapic = (volatile uint32_t*)madt.ioapic_addr;
+    ioapic_pins = ((ioapic_read(IOAPIC_VER) >> 16) & 0xFF) + 1;
+    for (i = 0; i < ioapic_pins; i++) {
+        ioapic_write(IOAPIC_REDTBL + 2 * i, IOAPIC_MASKED);
+    }
+    for (i = 0; i < ACPI_ISA_IRQS; i++) {
+        if (i != 2) {
+            ioapic_route(i, (pic_mask >> i) & 1);
+        }
+    }
+    park_pic();
+}
+
+int apic_init(void) {
+    uint8_t bsp;
+    unsigned int i;
+
+    if (!cpu_has_feature(CPUID_FEAT_EDX_APIC) || acpi_parse_madt(&madt) != 0 ||
+        map_identity(madt.lapic_addr, PAGE_SIZE, PTE_WRITABLE | PTE_PCD | PTE_PWT) != 0) {
+        return -1;
+    }
+    bsp = ((volatile uint32_t*)madt.lapic_addr)[LAPIC_ID / 4] >> 24;
+    cpus[0].apic_id = bsp;
+    cpus[0].online = 1;
+    num_cpus = 1;
+    for (i = 0; i < madt.num_lapics; i++) {
+        if (madt.lapic_ids[i] != bsp && num_cpus < MAX_CPUS) {
+            apic_cpu[madt.lapic_ids[i]] = num_cpus;
+            cpus[num_cpus].apic_id = madt.lapic_ids[i];
+            cpus[num_cpus].online = 0;
+            num_cpus++;
+        }
+    }
+    apic_cpu[bsp] = 0;
+    lapic = (volatile uint32_t*)madt.lapic_addr;
+    lapic_init();
+    if (madt.ioapic_addr != 0) {
+        ioapic_init();
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef __APIC_H__
+#define __APIC_H__
+
+#include <stdint.h>
+
+// Local APIC registers, as byte offsets
+#define LAPIC_ID        0x020
+#define LAPIC_TPR       0x080
+#define LAPIC_EOI       0x0B0
+#define LAPIC_SVR       0x0F0
+#define LAPIC_ICR_LO    0x300
+#define LAPIC_ICR_HI    0x310
+#define LAPIC_LVT_LINT0 0x350
+
+#define LAPIC_SVR_ENABLE 0x100
+#define LAPIC_LVT_MASKED 0x10000
+
+// ICR low word
+#define ICR_FIXED        0x000
+#define ICR_INIT         0x500
+#define ICR_STARTUP      0x600
+#define ICR_PENDING      0x1000
+#define ICR_ASSERT       0x4000
+
+// I/O APIC registers, reached through IOREGSEL/IOWIN
+#define IOAPIC_REGSEL  0x00
+#define IOAPIC_WIN     0x10
+#define IOAPIC_VER     0x01
+#define IOAPIC_REDTBL  0x10     // two 32-bit registers per entry
+
+#define IOAPIC_POLARITY_LOW 0x2000
+#define IOAPIC_LEVEL        0x8000
+#define IOAPIC_MASKED       0x10000
+
+// Vectors. ISA IRQs keep the ones remap_pic() gave them.
+#define IRQ_VECTOR_BASE 0x20
+#define RESCHED_VECTOR  0xF0
+#define TLB_VECTOR      0xF1
+#define SPURIOUS_VECTOR 0xFF
+
+// Read the MADT, enable the boot CPU's local APIC and move the ISA IRQs
+// from the 8259s to the I/O APIC, keeping their current masks. Without
+// a MADT the PICs stay in charge and only CPU 0 runs.
+// @return 0 if the local APIC is up
+int apic_init(void);
+// Enable the local APIC of the calling CPU
+void lapic_init(void);
+void lapic_eoi(void);
+void lapic_send_ipi(uint8_t apic_id, uint32_t icr);
+
+int ioapic_enabled(void);
+void ioapic_set_mask(uint8_t irq, int masked);
+
+#endif
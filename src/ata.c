@@ -0,0 +1,627 @@
+#include <stdint.h>
+#include "ide.h"
+#include "interrupt.h"
+#include "spinlock.h"
+#include "pci.h"
+#include "page.h"
+#include "paging.h"
+
+// Status register bits
+#define ATA_SR_ERR  0x01
+#define ATA_SR_DRQ  0x08
+#define ATA_SR_DF   0x20
+#define ATA_SR_BSY  0x80
+
+#define ATA_CMD_READ_SECTORS       0x20
+#define ATA_CMD_READ_SECTORS_EXT   0x24
+#define ATA_CMD_READ_DMA_EXT       0x25
+#define ATA_CMD_READ_MULTIPLE_EXT  0x29
+#define ATA_CMD_WRITE_SECTORS      0x30
+#define ATA_CMD_WRITE_SECTORS_EXT  0x34
+#define ATA_CMD_WRITE_DMA_EXT      0x35
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_READ_MULTIPLE      0xC4
+#define ATA_CMD_WRITE_MULTIPLE     0xC5
+#define ATA_CMD_SET_MULTIPLE       0xC6
+#define ATA_CMD_READ_DMA           0xC8
+#define ATA_CMD_WRITE_DMA          0xCA
+#define ATA_CMD_FLUSH_CACHE        0xE7
+#define ATA_CMD_FLUSH_CACHE_EXT    0xEA
+#define ATA_CMD_IDENTIFY           0xEC
+
+#define ATA_LBA28_LIMIT 0x10000000  // first sector LBA28 commands cannot reach
+
+// Register offsets from io_base
+#define ATA_REG_DATA     0
+#define ATA_REG_COUNT    2
+#define ATA_REG_LBA0     3
+#define ATA_REG_LBA1     4
+#define ATA_REG_LBA2     5
+#define ATA_REG_DRIVE    6
+#define ATA_REG_STATUS   7
+#define ATA_REG_COMMAND  7
+
+// Bus-master IDE registers, offsets from the channel's bmide base
+#define BM_REG_COMMAND 0
+#define BM_REG_STATUS  2
+#define BM_REG_PRDT    4
+
+#define BM_CMD_START 0x01
+#define BM_CMD_READ  0x08       // device to memory
+#define BM_SR_ERR    0x02
+#define BM_SR_IRQ    0x04
+
+// Physical Region Descriptor: one contiguous piece of a DMA transfer.
+// A region may not cross a 64 KiB boundary; a count of 0 means 64 KiB.
+struct prd {
+    uint32_t addr;
+    uint16_t count;
+    uint16_t flags;
+}__attribute__((packed));
+
+#define PRD_EOT 0x8000
+#define PRD_MAX (PAGE_SIZE / sizeof(struct prd))
+
+#define ATA_MAX_SECTORS 256     // a sector count of 0 means 256
+#define ATA_MAX_MULTIPLE 16     // sectors per DRQ block we ask for
+
+struct ata_channel {
+    uint16_t io_base;
+    uint16_t ctrl_base;
+    uint8_t irq;
+    int present;
+    unsigned int multiple;      // sectors per DRQ block with READ MULTIPLE, 0 if unused
+    unsigned int sectors;       // capacity from IDENTIFY, capped at 2^32 sectors
+    int lba48;                  // drive supports the EXT commands (word 83 bit 10)
+    int dma_capable;            // drive supports DMA (IDENTIFY word 49)
+    uint16_t bmide;             // bus-master registers, 0 without a PCI IDE controller
+    struct prd *prdt;           // one frame from the PFA, so it never crosses 64 KiB
+    int use_dma;                // current request is a DMA transfer
+    int write;                  // current request moves data to the drive
+    int flush;                  // current request is FLUSH CACHE, no data
+    // The command in flight, if any. lock covers all of it: the IRQ is
+    // handled on the boot CPU while the submitter may be on another.
+    spinlock_t lock;
+    volatile int busy;
+    unsigned int lba;
+    struct ata_seg segs[ATA_MAX_SEGS];  // copied from the caller
+    unsigned int nsegs;
+    unsigned int seg;           // segment the next sector goes to or from
+    unsigned int seg_off;       // sectors already moved within it
+    unsigned int remaining;     // sectors left in the whole request
+    unsigned int cmd_left;      // sectors left in the current command
+    ata_done_fn done;
+    void *arg;
+    int completed;              // done() is owed once the lock is dropped
+    int status;
+};
+
+static struct ata_channel channels[2] = {
+    { .io_base = 0x1F0, .ctrl_base = 0x3F6, .irq = 14 },
+    { .io_base = 0x170, .ctrl_base = 0x376, .irq = 15 },
+};
+
+static void ata_complete(struct ata_channel *ch, int status);
+
+static inline void insw(uint16_t port, void *buf, unsigned int count) {
+    asm volatile("rep insw" : "+D"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
+static inline void outsw(uint16_t port, const void *buf, unsigned int count) {
+    asm volatile("rep outsw" : "+S"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
+// Advance the transfer by n sectors, stepping through the segments
+static void ata_advance(struct ata_channel *ch, unsigned int n) {
+    ch->lba += n;
+    ch->remaining -= n;
+    ch->cmd_left -= n;
+    ch->seg_off += n;
+    while (ch->seg < ch->nsegs && ch->seg_off >= ch->segs[ch->seg].count) {
+        ch->seg_off -= ch->segs[ch->seg].count;
+        ch->seg++;
+    }
+}
+
+// Move n sectors between the data port and the segments
+static void ata_pio_move(struct ata_channel *ch, unsigned int n) {
+    struct ata_seg *sg;
+    unsigned char *buf;
+    unsigned int k;
+    while (n > 0) {
+        sg = &ch->segs[ch->seg];
+        k = sg->count - ch->seg_off;
+        if (k > n) {
+            k = n;
+        }
+        buf = sg->buffer + 512 * ch->seg_off;
+        if (ch->write) {
+            outsw(ch->io_base + ATA_REG_DATA, buf, 256 * k);
+        } else {
+            insw(ch->io_base + ATA_REG_DATA, buf, 256 * k);
+        }
+        ata_advance(ch, k);
+        n -= k;
+    }
+}
+
+// Describe the next count sectors of the segments in the channel's PRD
+// table, walking the page tables so buffers in lazily mapped regions
+// work too. Physically adjacent pages are merged while they stay inside
+// one 64 KiB window.
+static int ata_build_prdt(struct ata_channel *ch, unsigned int count) {
+    int n = -1;
+    uint32_t cur_len = 0;
+    unsigned int seg = ch->seg;
+    unsigned int off = ch->seg_off;
+    unsigned int k;
+    unsigned char *buf;
+    uint32_t len;
+    uint32_t va;
+    uint32_t pa;
+    uint32_t chunk;
+
+    while (count > 0) {
+        k = ch->segs[seg].count - off;
+        if (k > count) {
+            k = count;
+        }
+        buf = ch->segs[seg].buffer + 512 * off;
+        len = 512 * k;
+        if ((uint32_t)buf & 1) {
+            return -1;      // bus master needs word-aligned buffers
+        }
+        while (len > 0) {
+            va = (uint32_t)buf;
+            pa = virt_to_phys(va);
+            if (pa == 0) {
+                return -1;
+            }
+            chunk = PAGE_SIZE - (va & (PAGE_SIZE - 1));
+            if (chunk > len) {
+                chunk = len;
+            }
+            if (n >= 0 && ch->prdt[n].addr + cur_len == pa &&
+                ((ch->prdt[n].addr ^ (pa + chunk - 1)) & 0xFFFF0000) == 0) {
+                cur_len += chunk;
+            } else {
+                if (++n >= (int)PRD_MAX) {
+                    return -1;
+                }
+                ch->prdt[n].addr = pa;
+                ch->prdt[n].flags = 0;
+                cur_len = chunk;
+            }
+            ch->prdt[n].count = cur_len & 0xFFFF;
+            buf += chunk;
+            len -= chunk;
+        }
+        count -= k;
+        seg++;
+        off = 0;
+    }
+    ch->prdt[n].flags = PRD_EOT;
+    return 0;
+}
+
+// Run the IRQ handler by hand, for callers that wait with interrupts
+// off (e.g. inside another ISR). Reading the status acknowledges the
+// drive, so the IRQ that arrives later is ignored as spurious.
+void ata_poll(void) {
+    ata_irq(0);
+}
+
+// Wait for BSY to clear, polled. Returns the final status.
+static uint8_t ata_wait_idle(struct ata_channel *ch) {
+    uint8_t status;
+    int i;
+    for (i = 0; i < 4; i++) {
+        inb(ch->ctrl_base);     // 400ns settle
+    }
+    do {
+        status = inb(ch->io_base + ATA_REG_STATUS);
+    } while (status & ATA_SR_BSY);
+    return status;
+}
+
+// Program LBA and sector count. Commands that end past the LBA28 range
+// use the LBA48 layout: each register is written twice, high byte first.
+// Returns nonzero if the EXT form of the command has to be sent.
+static int ata_setup_lba(struct ata_channel *ch, unsigned int count) {
+    uint16_t io = ch->io_base;
+    if (ch->lba48 && (ch->lba + count > ATA_LBA28_LIMIT || ch->lba + count < ch->lba)) {
+        outb(io + ATA_REG_DRIVE, 0x40);
+        outb(io + ATA_REG_COUNT, (count >> 8) & 0xFF);
+        outb(io + ATA_REG_LBA0, (ch->lba >> 24) & 0xFF);
+        outb(io + ATA_REG_LBA1, 0);
+        outb(io + ATA_REG_LBA2, 0);
+        outb(io + ATA_REG_COUNT, count & 0xFF);
+        outb(io + ATA_REG_LBA0, ch->lba & 0xFF);
+        outb(io + ATA_REG_LBA1, (ch->lba >> 8) & 0xFF);
+        outb(io + ATA_REG_LBA2, (ch->lba >> 16) & 0xFF);
+        return 1;
+    }
+    outb(io + ATA_REG_DRIVE, 0xE0 | ((ch->lba >> 24) & 0x0F));
+    outb(io + ATA_REG_COUNT, count & 0xFF);
+    outb(io + ATA_REG_LBA0, ch->lba & 0xFF);
+    outb(io + ATA_REG_LBA1, (ch->lba >> 8) & 0xFF);
+    outb(io + ATA_REG_LBA2, (ch->lba >> 16) & 0xFF);
+    return 0;
+}
+
+// Pick the command for the current request: DMA, MULTIPLE or plain
+// SECTORS, read or write, LBA28 or LBA48
+static uint8_t ata_command(struct ata_channel *ch, int ext) {
+    if (ch->use_dma) {
+        if (ch->write) {
+            return ext ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA;
+        }
+        return ext ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA;
+    }
+    if (ch->multiple) {
+        if (ch->write) {
+            return ext ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_WRITE_MULTIPLE;
+        }
+        return ext ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE;
+    }
+    if (ch->write) {
+        return ext ? ATA_CMD_WRITE_SECTORS_EXT : ATA_CMD_WRITE_SECTORS;
+    }
+    return ext ? ATA_CMD_READ_SECTORS_EXT : ATA_CMD_READ_SECTORS;
+}
+
+// Hand the drive one DRQ block of a PIO write
+static void ata_pio_out(struct ata_channel *ch) {
+    unsigned int n = 1;
+    if (ch->multiple) {
+        n = ch->cmd_left < ch->multiple ? ch->cmd_left : ch->multiple;
+    }
+    ata_pio_move(ch, n);
+}
+
+// Program the next command of the request (up to 256 sectors), with
+// the drive's interrupt enabled
+static void ata_issue(struct ata_channel *ch) {
+    unsigned int count = ch->remaining;
+    uint8_t status;
+    int ext;
+    if (count > ATA_MAX_SECTORS) {
+        count = ATA_MAX_SECTORS;
+    }
+    ch->cmd_left = count;
+    if (ch->use_dma && ata_build_prdt(ch, count) != 0) {
+        ch->use_dma = 0;    // finish this request with PIO
+    }
+    if (ch->use_dma) {
+        outb(ch->bmide + BM_REG_COMMAND, 0);
+        outl(ch->bmide + BM_REG_PRDT, (uint32_t)ch->prdt);
+        outb(ch->bmide + BM_REG_COMMAND, ch->write ? 0 : BM_CMD_READ);
+        outb(ch->bmide + BM_REG_STATUS, BM_SR_ERR | BM_SR_IRQ);    // write 1 to clear
+    }
+    outb(ch->ctrl_base, 0x00);      // nIEN = 0
+    ext = ata_setup_lba(ch, count);
+    outb(ch->io_base + ATA_REG_COMMAND, ata_command(ch, ext));
+    if (ch->use_dma) {
+        outb(ch->bmide + BM_REG_COMMAND, (ch->write ? 0 : BM_CMD_READ) | BM_CMD_START);
+    } else if (ch->write) {
+        // The first block of a PIO write goes out without an interrupt
+        status = ata_wait_idle(ch);
+        if ((status & (ATA_SR_ERR | ATA_SR_DF)) || !(status & ATA_SR_DRQ)) {
+            ata_complete(ch, -1);
+            return;
+        }
+        ata_pio_out(ch);
+    }
+}
+
+// A DMA command raises one interrupt when the whole transfer is done
+static void ata_dma_irq(struct ata_channel *ch, uint8_t status) {
+    uint8_t bm_status = inb(ch->bmide + BM_REG_STATUS);
+    if (!(bm_status & BM_SR_IRQ)) {
+        return;     // not from our transfer
+    }
+    outb(ch->bmide + BM_REG_COMMAND, 0);
+    outb(ch->bmide + BM_REG_STATUS, BM_SR_ERR | BM_SR_IRQ);
+    if ((bm_status & BM_SR_ERR) || (status & (ATA_SR_ERR | ATA_SR_DF))) {
+        ata_complete(ch, -1);
+        return;
+    }
+    ata_advance(ch, ch->cmd_left);
+    if (ch->remaining == 0) {
+        ata_complete(ch, 0);
+    } else {
+        ata_issue(ch);
+    }
+}
+
+// Lock held. The callback may start the next transfer, so it runs from
+// ata_unlock() instead.
+static void ata_complete(struct ata_channel *ch, int status) {
+    ch->busy = 0;
+    ch->completed = 1;
+    ch->status = status;
+}
+
+// Drop the channel lock, then run the completion it recorded, if any
+static void ata_unlock(struct ata_channel *ch, uint32_t flags) {
+    ata_done_fn done = 0;
+    void *arg = 0;
+    int status = 0;
+    if (ch->completed) {
+        ch->completed = 0;
+        done = ch->done;
+        arg = ch->arg;
+        status = ch->status;
+    }
+    spin_unlock_irqrestore(&ch->lock, flags);
+    if (done) {
+        done(status, arg);
+    }
+}
+
+// For PIO writes each interrupt means the drive took the last block:
+// send the next one, start the next command, or complete
+static void ata_write_irq(struct ata_channel *ch) {
+    if (ch->cmd_left > 0) {
+        ata_pio_out(ch);
+    } else if (ch->remaining > 0) {
+        ata_issue(ch);
+    } else {
+        ata_complete(ch, 0);
+    }
+}
+
+// One interrupt per DRQ block (one sector, or 'multiple' sectors with
+// READ MULTIPLE): drain it from the data port, then either wait for the
+// next block, start the next command, or complete
+void ata_irq(int channel) {
+    struct ata_channel *ch = &channels[channel];
+    uint8_t status = inb(ch->io_base + ATA_REG_STATUS);     // acknowledges INTRQ
+    unsigned int n;
+    uint32_t flags = spin_lock_irqsave(&ch->lock);
+
+    if (!ch->busy) {
+        goto out;   // spurious, or a polled command finishing
+    }
+    if (ch->flush) {
+        if (!(status & ATA_SR_BSY)) {
+            ata_complete(ch, (status & (ATA_SR_ERR | ATA_SR_DF)) ? -1 : 0);
+        }
+        goto out;
+    }
+    if (ch->use_dma) {
+        ata_dma_irq(ch, status);
+        goto out;
+    }
+    if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+        ata_complete(ch, -1);
+        goto out;
+    }
+    if (ch->write) {
+        if (!(status & ATA_SR_BSY)) {
+            ata_write_irq(ch);
+        }
+        goto out;
+    }
+    if (status & ATA_SR_BSY || !(status & ATA_SR_DRQ)) {
+        goto out;
+    }
+    n = 1;
+    if (ch->multiple) {
+        n = ch->cmd_left < ch->multiple ? ch->cmd_left : ch->multiple;
+    }
+    ata_pio_move(ch, n);
+    if (ch->remaining == 0) {
+        ata_complete(ch, 0);
+    } else if (ch->cmd_left == 0) {
+        ata_issue(ch);
+    }
+out:
+    ata_unlock(ch, flags);
+}
+
+// IDENTIFY the master and switch it to the largest READ MULTIPLE block
+// size it supports (capped at ATA_MAX_MULTIPLE). Runs polled.
+static int ata_identify(struct ata_channel *ch) {
+    uint16_t id[256];
+    uint8_t status;
+    unsigned int max_multiple;
+
+    outb(ch->ctrl_base, 0x02);      // nIEN = 1 while probing
+    outb(ch->io_base + ATA_REG_DRIVE, 0xA0);
+    outb(ch->io_base + ATA_REG_COUNT, 0);
+    outb(ch->io_base + ATA_REG_LBA0, 0);
+    outb(ch->io_base + ATA_REG_LBA1, 0);
+    outb(ch->io_base + ATA_REG_LBA2, 0);
+    outb(ch->io_base + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+    if (inb(ch->io_base + ATA_REG_STATUS) == 0) {
+        return -1;      // no device
+    }
+    status = ata_wait_idle(ch);
+    // ATAPI and SATA devices abort IDENTIFY and leave a signature here
+    if (inb(ch->io_base + ATA_REG_LBA1) != 0 || inb(ch->io_base + ATA_REG_LBA2) != 0) {
+        return -1;
+    }
+    while (!(status & (ATA_SR_DRQ | ATA_SR_ERR))) {
+        status = inb(ch->io_base + ATA_REG_STATUS);
+    }
+    if (status & ATA_SR_ERR) {
+        return -1;
+    }
+    insw(ch->io_base + ATA_REG_DATA, id, 256);
+    ch->sectors = id[60] | ((uint32_t)id[61] << 16);
+    // Word 83 bit 10: 48-bit address feature set. Words 100-103 hold the
+    // LBA48 capacity; our LBAs are 32 bits wide, so keep the low half.
+    ch->lba48 = (id[83] & 0x0400) != 0;
+    if (ch->lba48) {
+        ch->sectors = id[100] | ((uint32_t)id[101] << 16);
+        if (id[102] != 0 || id[103] != 0) {
+            ch->sectors = 0xFFFFFFFF;
+        }
+    }
+    ch->dma_capable = (id[49] & 0x0100) != 0;
+
+    // Word 47 bits 7:0: max sectors per DRQ block for READ/WRITE MULTIPLE
+    max_multiple = id[47] & 0xFF;
+    if (max_multiple > ATA_MAX_MULTIPLE) {
+        max_multiple = ATA_MAX_MULTIPLE;
+    }
+    ch->multiple = 0;
+    if (max_multiple > 1) {
+        outb(ch->io_base + ATA_REG_DRIVE, 0xE0);
+        outb(ch->io_base + ATA_REG_COUNT, max_multiple);
+        outb(ch->io_base + ATA_REG_COMMAND, ATA_CMD_SET_MULTIPLE);
+        status = ata_wait_idle(ch);
+        if (!(status & (ATA_SR_ERR | ATA_SR_DF))) {
+            ch->multiple = max_multiple;
+        }
+    }
+    return 0;
+}
+
+// Find the PCI IDE controller (the PIIX in QEMU) and set up bus-master
+// DMA for the primary channel. BAR4 holds the bus-master I/O ports.
+static void ata_init_dma(struct ata_channel *ch) {
+    struct pci_device *pdev = pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE);
+    struct ppage *pp;
+    if (pdev == 0 || !(pdev->bar[4] & 1) || !ch->dma_capable) {
+        return;
+    }
+    pp = allocate_physical_pages(1);
+    if (pp == 0) {
+        return;
+    }
+    pci_enable_bus_master(pdev);
+    ch->prdt = (struct prd*)pp->physical_addr;
+    ch->bmide = pdev->bar[4] & 0xFFFC;
+}
+
+int ata_init(void) {
+    struct ata_channel *ch = &channels[0];
+    // A floating bus reads back 0xFF: nothing attached
+    ch->present = inb(ch->io_base + ATA_REG_STATUS) != 0xFF && ata_identify(ch) == 0;
+    if (ch->present) {
+        ata_init_dma(ch);
+    }
+    IRQ_clear_mask(2);      // cascade to the slave PIC
+    IRQ_clear_mask(channels[0].irq);
+    IRQ_clear_mask(channels[1].irq);
+    return ch->present ? 0 : -1;
+}
+
+unsigned int ata_multiple(void) {
+    return channels[0].multiple;
+}
+
+int ata_dma_enabled(void) {
+    return channels[0].bmide != 0;
+}
+
+unsigned int ata_sectors(void) {
+    return channels[0].sectors;
+}
+
+int ata_transfer_async(unsigned int lba, const struct ata_seg *segs, unsigned int nsegs,
+                       int write, ata_done_fn done, void *arg) {
+    struct ata_channel *ch = &channels[0];
+    unsigned int total = 0;
+    unsigned int i;
+    uint32_t flags;
+    if (!ch->present || nsegs == 0 || nsegs > ATA_MAX_SEGS) {
+        return -1;
+    }
+    for (i = 0; i < nsegs; i++) {
+        if (segs[i].count == 0) {
+            return -1;
+        }
+        total += segs[i].count;
+    }
+    flags = spin_lock_irqsave(&ch->lock);
+    if (ch->busy) {
+        spin_unlock_irqrestore(&ch->lock, flags);
+        return -1;
+    }
+    ch->busy = 1;
+    ch->use_dma = ch->bmide != 0;
+    ch->write = write;
+    ch->flush = 0;
+    ch->lba = lba;
+    for (i = 0; i < nsegs; i++) {
+        ch->segs[i] = segs[i];
+    }
+    ch->nsegs = nsegs;
+    ch->seg = 0;
+    ch->seg_off = 0;
+    ch->remaining = total;
+    ch->done = done;
+    ch->arg = arg;
+    ata_issue(ch);
+    ata_unlock(ch, flags);
+    return 0;
+}
+
+// FLUSH CACHE completes once the drive's write cache is on the medium,
+// which can take a while; the drive raises one interrupt at the end
+int ata_flush_async(ata_done_fn done, void *arg) {
+    struct ata_channel *ch = &channels[0];
+    uint32_t flags;
+    if (!ch->present) {
+        return -1;
+    }
+    flags = spin_lock_irqsave(&ch->lock);
+    if (ch->busy) {
+        spin_unlock_irqrestore(&ch->lock, flags);
+        return -1;
+    }
+    ch->busy = 1;
+    ch->write = 0;
+    ch->flush = 1;
+    ch->use_dma = 0;
+    ch->remaining = 0;
+    ch->done = done;
+    ch->arg = arg;
+    outb(ch->ctrl_base, 0x00);      // nIEN = 0
+    outb(ch->io_base + ATA_REG_DRIVE, ch->lba48 ? 0x40 : 0xE0);
+    outb(ch->io_base + ATA_REG_COMMAND,
+         ch->lba48 ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE);
+    spin_unlock_irqrestore(&ch->lock, flags);
+    return 0;
+}
+
+struct ata_polled {
+    volatile int done;
+    int status;
+};
+
+static void ata_polled_done(int status, void *arg) {
+    struct ata_polled *p = arg;
+    p->status = status;
+    p->done = 1;
+}
+
+// Issue a transfer and drive it to completion by polling, without
+// sleeping or waiting for an interrupt. A command blk has in flight is
+// polled to completion first.
+static int ata_polled_transfer(unsigned int lba, unsigned char *buffer,
+                               unsigned int numsectors, int write) {
+    struct ata_polled p = { 0, 0 };
+    struct ata_seg seg = { buffer, numsectors };
+    if (!channels[0].present || numsectors == 0) {
+        return -1;
+    }
+    while (ata_transfer_async(lba, &seg, 1, write, ata_polled_done, &p) != 0) {
+        ata_poll();
+    }
+    while (!p.done) {
+        ata_poll();
+    }
+    return p.status;
+}
+
+int ata_lba_read(unsigned int lba, unsigned char *buffer, unsigned int numsectors) {
+    return ata_polled_transfer(lba, buffer, numsectors, 0);
+}
+
+int ata_lba_write(unsigned int lba, const unsigned char *buffer, unsigned int numsectors) {
+    return ata_polled_transfer(lba, (unsigned char*)buffer, numsectors, 1);
+}
@@ -0,0 +1,402 @@
+#include "bcache.h"
+#include "blk.h"
+#include "ide.h"
+#include "heap.h"
+#include "spinlock.h"
+#include <stddef.h>
+
+#define NO_LBA 0xFFFFFFFF
+
+static struct buf *bufs;
+static struct buf *hash_table[BCACHE_NHASH];
+static struct buf *lru_head;    // most recently used
+static struct buf *lru_tail;    // least recently used
+static spinlock_t bcache_lock = SPINLOCK_INIT;
+static struct bcache_stats stats;
+
+static void copy_block(void *dest, const void *src) {
+    uint32_t *d = dest;
+    const uint32_t *s = src;
+    int i;
+    for (i = 0; i < BLOCK_SIZE / 4; i++) {
+        d[i] = s[i];
+    }
+}
+
+static unsigned int hash_lba(uint32_t lba) {
+    return lba & (BCACHE_NHASH - 1);
+}
+
+static void lru_unlink(struct buf *b) {
+    if (b->lru_prev != NULL) {
+        b->lru_prev->lru_next = b->lru_next;
+    } else {
+        lru_head = b->lru_next;
+    }
+    if (b->lru_next != NULL) {
+        b->lru_next->lru_prev = b->lru_prev;
+    } else {
+        lru_tail = b->lru_prev;
+    }
+}
+
+static void lru_push_front(struct buf *b) {
+    b->lru_prev = NULL;
+    b->lru_next = lru_head;
+    if (lru_head != NULL) {
+        lru_head->lru_prev = b;
+    } else {
+        lru_tail = b;
+    }
+    lru_head = b;
+}
+
+static void hash_remove(struct buf *b) {
+    struct buf **link = &hash_table[hash_lba(b->lba)];
+    while (*link != NULL && *link != b) {
+        link = &(*link)->hash_next;
+    }
+    if (*link != NULL) {
+        *link = b->hash_next;
+    }
+    b->hash_next = NULL;
+}
+
+// bcache_lock held
+static struct buf *lookup(uint32_t lba) {
+    struct buf *b = hash_table[hash_lba(lba)];
+    while (b != NULL && b->lba != lba) {
+        b = b->hash_next;
+    }
+    return b;
+}
+
+// Recycle the least recently used clean, unreferenced buffer for lba.
+// bcache_lock held. Returns NULL if every buffer is pinned or dirty.
+static struct buf *getblk(uint32_t lba) {
+    struct buf *b = lru_tail;
+    while (b != NULL && (b->refcnt > 0 || (b->flags & B_DIRTY))) {
+        b = b->lru_prev;
+    }
+    if (b == NULL) {
+        return NULL;
+    }
+    if (b->lba != NO_LBA) {
+        hash_remove(b);
+        if (b->flags & B_VALID) {
+            stats.evictions++;
+        }
+    }
+    b->lba = lba;
+    b->flags = 0;
+    b->hash_next = hash_table[hash_lba(lba)];
+    hash_table[hash_lba(lba)] = b;
+    lru_unlink(b);
+    lru_push_front(b);
+    return b;
+}
+
+int bcache_init(void) {
+    uint8_t *data;
+    int i;
+    if (bufs != NULL) {
+        return 0;
+    }
+    if (blk_init() != 0) {
+        return -1;
+    }
+    bufs = kzalloc(BCACHE_NBUF * sizeof(struct buf));
+    data = kmalloc(BCACHE_NBUF * BLOCK_SIZE);
+    if (bufs == NULL || data == NULL) {
+        kfree(bufs);
+        kfree(data);
+        bufs = NULL;
+        return -1;
+    }
+    for (i = 0; i < BCACHE_NBUF; i++) {
+        bufs[i].data = data + i * BLOCK_SIZE;
+        bufs[i].lba = NO_LBA;
+        lru_push_front(&bufs[i]);
+    }
+    return 0;
+}
+
+// Return a referenced buffer holding sector lba, reading it on a miss
+struct buf *bread(uint32_t lba) {
+    struct buf *b;
+    uint32_t flags = spin_lock_irqsave(&bcache_lock);
+    b = lookup(lba);
+    while (b != NULL && (b->flags & B_READING)) {
+        // Read-ahead already on its way: wait for it rather than reading twice
+        b->refcnt++;
+        spin_unlock_irqrestore(&bcache_lock, flags);
+        blk_wait(&b->flags, B_READING);
+        flags = spin_lock_irqsave(&bcache_lock);
+        b->refcnt--;
+        b = lookup(lba);
+    }
+    if (b != NULL && (b->flags & B_VALID)) {
+        stats.hits++;
+        b->refcnt++;
+        spin_unlock_irqrestore(&bcache_lock, flags);
+        return b;
+    }
+    if (b == NULL) {
+        b = getblk(lba);
+        if (b == NULL) {
+            spin_unlock_irqrestore(&bcache_lock, flags);
+            return NULL;
+        }
+    }
+    stats.misses++;
+    b->refcnt++;
+    spin_unlock_irqrestore(&bcache_lock, flags);
+
+    if (blk_read(lba, b->data, 1) != 0) {
+        brelse(b);
+        return NULL;
+    }
+    b->flags |= B_VALID;
+    return b;
+}
+
+void brelse(struct buf *b) {
+    uint32_t flags = spin_lock_irqsave(&bcache_lock);
+    b->refcnt--;
+    if (b->refcnt == 0) {
+        lru_unlink(b);
+        lru_push_front(b);
+    }
+    spin_unlock_irqrestore(&bcache_lock, flags);
+}
+
+// Mark a referenced buffer modified; it stays cached until written back
+void bdirty(struct buf *b) {
+    uint32_t flags = spin_lock_irqsave(&bcache_lock);
+    if (!(b->flags & B_DIRTY)) {
+        b->flags |= B_DIRTY;
+        stats.dirty++;
+    }
+    spin_unlock_irqrestore(&bcache_lock, flags);
+}
+
+// Read count sectors into dst. Cached sectors are copied out; each run of
+// missing sectors is fetched with one disk command straight into dst and
+// then copied into the cache.
+int bcache_read(uint32_t lba, void *dst, uint32_t count) {
+    uint8_t *out = dst;
+    uint32_t i = 0;
+    uint32_t run;
+    uint32_t j;
+    struct buf *b;
+    uint32_t flags;
+
+    while (i < count) {
+        flags = spin_lock_irqsave(&bcache_lock);
+        b = lookup(lba + i);
+        if (b != NULL && (b->flags & B_READING)) {
+            b->refcnt++;
+            spin_unlock_irqrestore(&bcache_lock, flags);
+            blk_wait(&b->flags, B_READING);
+            brelse(b);
+            continue;       // look again: valid now, unless the read failed
+        }
+        if (b != NULL && (b->flags & B_VALID)) {
+            copy_block(out + i * BLOCK_SIZE, b->data);
+            lru_unlink(b);
+            lru_push_front(b);
+            stats.hits++;
+            spin_unlock_irqrestore(&bcache_lock, flags);
+            i++;
+            continue;
+        }
+        run = 1;
+        while (i + run < count && ((b = lookup(lba + i + run)) == NULL ||
+                                   !(b->flags & (B_VALID | B_READING)))) {
+            run++;
+        }
+        stats.misses += run;
+        spin_unlock_irqrestore(&bcache_lock, flags);
+
+        if (blk_read(lba + i, out + i * BLOCK_SIZE, run) != 0) {
+            return -1;
+        }
+
+        flags = spin_lock_irqsave(&bcache_lock);
+        for (j = i; j < i + run; j++) {
+            b = lookup(lba + j);
+            if (b == NULL) {
+                b = getblk(lba + j);
+            }
+            if (b != NULL && b->refcnt == 0 && !(b->flags & B_VALID)) {
+                copy_block(b->data, out + j * BLOCK_SIZE);
+                b->flags |= B_VALID;
+            }
+        }
+        spin_unlock_irqrestore(&bcache_lock, flags);
+        i += run;
+    }
+    return 0;
+}
+
+// Write count sectors from src straight to disk, then update any cached
+// copies so later reads see the new data. If the write fails the cache
+// is left alone: it must not serve data the disk does not have, and
+// dirty buffers keep the changes they were still holding.
+int bcache_write(uint32_t lba, const void *src, uint32_t count) {
+    const uint8_t *in = src;
+    uint32_t i;
+    struct buf *b;
+    uint32_t flags;
+
+    if (blk_write(lba, src, count) != 0) {
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        flags = spin_lock_irqsave(&bcache_lock);
+        b = lookup(lba + i);
+        if (b != NULL && (b->flags & B_READING)) {
+            // Let the read-ahead land first so it can't overwrite us
+            // with what was on disk before
+            b->refcnt++;
+            spin_unlock_irqrestore(&bcache_lock, flags);
+            blk_wait(&b->flags, B_READING);
+            flags = spin_lock_irqsave(&bcache_lock);
+            b->refcnt--;
+        }
+        if (b != NULL) {
+            copy_block(b->data, in + i * BLOCK_SIZE);
+            b->flags |= B_VALID;
+            if (b->flags & B_DIRTY) {
+                b->flags &= ~B_DIRTY;
+                stats.dirty--;
+            }
+        }
+        spin_unlock_irqrestore(&bcache_lock, flags);
+    }
+    return 0;
+}
+
+// Completion of a read-ahead sector, from the disk interrupt
+static void bcache_prefetch_done(int status, void *arg) {
+    struct buf *b = arg;
+    uint32_t flags = spin_lock_irqsave(&bcache_lock);
+    if (status == 0) {
+        b->flags |= B_VALID;
+    }
+    b->flags &= ~B_READING;
+    b->refcnt--;
+    spin_unlock_irqrestore(&bcache_lock, flags);
+}
+
+// Start reading the sectors of [lba, lba+count) that are not cached yet,
+// without waiting. Each one is queued under a plug so the elevator sends
+// a run as one command; bread/bcache_read wait for sectors still in flight.
+void bcache_prefetch(uint32_t lba, uint32_t count) {
+    struct buf *b;
+    uint32_t flags;
+    uint32_t i;
+
+    blk_plug();
+    for (i = 0; i < count; i++) {
+        flags = spin_lock_irqsave(&bcache_lock);
+        b = lookup(lba + i);
+        if (b == NULL) {
+            b = getblk(lba + i);
+        }
+        if (b == NULL) {
+            spin_unlock_irqrestore(&bcache_lock, flags);
+            break;      // everything pinned: no room to read ahead
+        }
+        if (b->flags & (B_VALID | B_READING)) {
+            spin_unlock_irqrestore(&bcache_lock, flags);
+            continue;
+        }
+        b->flags |= B_READING;
+        b->refcnt++;
+        stats.readahead++;
+        spin_unlock_irqrestore(&bcache_lock, flags);
+        if (blk_submit(lba + i, b->data, 1, 0, bcache_prefetch_done, b) != 0) {
+            bcache_prefetch_done(-1, b);
+        }
+    }
+    blk_unplug();
+}
+
+// Write a referenced buffer back to disk if it is dirty
+int bwrite(struct buf *b) {
+    uint32_t flags;
+    if (!(b->flags & B_DIRTY)) {
+        return 0;
+    }
+    if (blk_write(b->lba, b->data, 1) != 0) {
+        return -1;
+    }
+    flags = spin_lock_irqsave(&bcache_lock);
+    b->flags &= ~B_DIRTY;
+    stats.dirty--;
+    spin_unlock_irqrestore(&bcache_lock, flags);
+    return 0;
+}
+
+// Write-back in progress in bcache_sync
+static struct {
+    volatile uint32_t pending;
+    int status;
+} sync_state;
+
+// Completion of one buffer's write-back, from the disk interrupt
+static void bcache_sync_done(int status, void *arg) {
+    struct buf *b = arg;
+    uint32_t flags = spin_lock_irqsave(&bcache_lock);
+    if (status == 0) {
+        b->flags &= ~B_DIRTY;
+        stats.dirty--;
+    } else {
+        sync_state.status = -1;
+    }
+    b->refcnt--;
+    sync_state.pending--;
+    spin_unlock_irqrestore(&bcache_lock, flags);
+}
+
+// Write back every dirty buffer, then flush the drive's write cache.
+// The writes are queued under a plug so the elevator can sort them and
+// merge neighbouring sectors into a few large commands.
+int bcache_sync(void) {
+    struct buf *b;
+    uint32_t flags;
+    int i;
+
+    sync_state.pending = 1;     // held until everything is queued
+    sync_state.status = 0;
+    blk_plug();
+    for (i = 0; bufs != NULL && i < BCACHE_NBUF; i++) {
+        b = &bufs[i];
+        flags = spin_lock_irqsave(&bcache_lock);
+        if (!(b->flags & B_DIRTY)) {
+            spin_unlock_irqrestore(&bcache_lock, flags);
+            continue;
+        }
+        b->refcnt++;    // pin it while the write is in flight
+        sync_state.pending++;
+        spin_unlock_irqrestore(&bcache_lock, flags);
+        if (blk_submit(b->lba, b->data, 1, 1, bcache_sync_done, b) != 0) {
+            bcache_sync_done(-1, b);
+        }
+    }
+    blk_unplug();
+    flags = spin_lock_irqsave(&bcache_lock);
+    sync_state.pending--;
+    spin_unlock_irqrestore(&bcache_lock, flags);
+    blk_wait(&sync_state.pending, 0xFFFFFFFF);
+
+    if (blk_flush() != 0) {
+        sync_state.status = -1;
+    }
+    return sync_state.status;
+}
+
+void get_bcache_stats(struct bcache_stats *out) {
+    *out = stats;
+}
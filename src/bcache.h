@@ -0,0 +1,44 @@
+#ifndef __BCACHE_H__
+#define __BCACHE_H__
+
+#include <stdint.h>
+
+#define BLOCK_SIZE   512
+#define BCACHE_NBUF  256        // 128 KiB of cached sectors
+#define BCACHE_NHASH 64         // must be a power of two
+
+// buf flags
+#define B_VALID 0x01            // data holds the sector's contents
+#define B_DIRTY 0x02            // data is newer than the disk; bwrite/bcache_sync clear it
+#define B_READING 0x04          // a read-ahead is filling data
+
+struct buf {
+    struct buf *hash_next;
+    struct buf *lru_next;       // towards least recently used
+    struct buf *lru_prev;
+    uint32_t lba;
+    uint32_t refcnt;
+    volatile uint32_t flags;
+    uint8_t *data;
+};
+
+struct bcache_stats {
+    unsigned int hits;
+    unsigned int misses;
+    unsigned int evictions;
+    unsigned int dirty;
+    unsigned int readahead;     // sectors prefetched by bcache_prefetch
+};
+
+int bcache_init(void);
+struct buf *bread(uint32_t lba);
+void brelse(struct buf *b);
+void bdirty(struct buf *b);
+int bwrite(struct buf *b);
+int bcache_sync(void);
+int bcache_read(uint32_t lba, void *dst, uint32_t count);
+int bcache_write(uint32_t lba, const void *src, uint32_t count);
+void bcache_prefetch(uint32_t lba, uint32_t count);
+void get_bcache_stats(struct bcache_stats *stats);
+
+#endif
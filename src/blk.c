@@ -0,0 +1,375 @@
+#include "blk.h"
+#include "ide.h"
+#include "heap.h"
+#include "spinlock.h"
+#include "sched.h"
+#include <stddef.h>
+
+struct blk_request {
+    struct blk_request *next;
+    uint32_t lba;
+    uint32_t count;
+    uint8_t *buffer;
+    int write;
+    int flush;                  // barrier: FLUSH CACHE, no data
+    uint32_t deadline;          // dispatch number it must not wait past
+    blk_done_fn done;
+    void *arg;
+};
+
+static struct kmem_cache *req_cache;
+static struct blk_request *queue;       // pending, sorted by LBA
+static struct blk_request *active;      // the requests in the command in flight
+static struct blk_request *flushes;     // barriers waiting for the queue to drain, FIFO
+static struct blk_request *held;        // submitted behind a barrier, FIFO
+static struct blk_request **held_tail = &held;
+static spinlock_t blk_lock = SPINLOCK_INIT;
+static uint32_t head_lba;               // where the last command ended
+static uint32_t dispatches;
+static int plugged;
+static int waiters;                     // blk_wait callers; they override plugs
+static struct blk_stats stats;
+static struct wait_queue blk_waitq = WAIT_QUEUE_INIT;
+
+static void blk_complete(int status, void *arg);
+
+// Call done() for a list of finished requests and free them. Runs
+// without blk_lock so callbacks can submit more I/O.
+static void blk_finish(struct blk_request *r, int status) {
+    struct blk_request *next;
+    if (r == NULL) {
+        return;
+    }
+    while (r != NULL) {
+        next = r->next;
+        if (r->done) {
+            r->done(status, r->arg);
+        }
+        kmem_cache_free(req_cache, r);
+        r = next;
+    }
+    // Waiters check their own condition, so one queue serves them all
+    wake_up(&blk_waitq);
+}
+
+// Elevator: keep sweeping upwards from where the last command ended and
+// wrap to the lowest LBA at the top (C-SCAN). A request that has been
+// passed over for BLK_DEADLINE commands goes next regardless.
+// blk_lock held. Returns the link pointing at the chosen request.
+static struct blk_request **blk_pick(void) {
+    struct blk_request **link;
+    struct blk_request **up = NULL;
+    struct blk_request **expired = NULL;
+    for (link = &queue; *link != NULL; link = &(*link)->next) {
+        if ((int32_t)(dispatches - (*link)->deadline) >= 0 &&
+            (expired == NULL || (int32_t)((*link)->deadline - (*expired)->deadline) < 0)) {
+            expired = link;
+        }
+        if (up == NULL && (*link)->lba >= head_lba) {
+            up = link;
+        }
+    }
+    if (expired != NULL) {
+        return expired;
+    }
+    return up != NULL ? up : &queue;
+}
+
+// Add r to the sorted queue. blk_lock held.
+static void blk_insert(struct blk_request *r) {
+    struct blk_request **link = &queue;
+    r->deadline = dispatches + BLK_DEADLINE;
+    // Insert after requests with the same LBA to keep their order
+    while (*link != NULL && (*link)->lba <= r->lba) {
+        link = &(*link)->next;
+    }
+    r->next = *link;
+    *link = r;
+}
+
+// A barrier finished: let the requests that arrived behind it into the
+// queue. Any later barrier now waits for them too. blk_lock held.
+static void blk_release_held(void) {
+    struct blk_request *r;
+    while ((r = held) != NULL) {
+        held = r->next;
+        blk_insert(r);
+    }
+    held_tail = &held;
+}
+
+// Send the next command if the drive is idle: the chosen request plus
+// every queued request that continues it on disk in the same direction.
+// blk_lock held. Returns requests that could not be issued, for the
+// caller to fail once the lock is dropped.
+static struct blk_request *blk_dispatch(int force) {
+    struct ata_seg segs[ATA_MAX_SEGS];
+    struct blk_request **link;
+    struct blk_request **tail = &active;
+    struct blk_request *first;
+    struct blk_request *r;
+    struct blk_request *failed;
+    unsigned int nsegs = 0;
+    uint32_t end;
+    uint32_t total = 0;
+
+    if (active != NULL) {
+        return NULL;
+    }
+    if (queue == NULL) {
+        // Everything ahead of the oldest barrier has completed
+        if (flushes != NULL) {
+            active = flushes;
+            flushes = active->next;
+            active->next = NULL;
+            dispatches++;
+            stats.commands++;
+            if (ata_flush_async(blk_complete, NULL) != 0) {
+                failed = active;
+                active = NULL;
+                blk_release_held();
+                failed->next = blk_dispatch(force);
+                return failed;
+            }
+        }
+        return NULL;
+    }
+    if (plugged && !force) {
+        return NULL;
+    }
+    link = blk_pick();
+    first = *link;
+    end = first->lba;
+    // The queue is sorted, so the run continues right behind first
+    while ((r = *link) != NULL && r->lba == end && r->write == first->write &&
+           total + r->count <= BLK_MAX_SECTORS) {
+        if (nsegs > 0 && segs[nsegs - 1].buffer + 512 * segs[nsegs - 1].count == r->buffer) {
+            segs[nsegs - 1].count += r->count;
+        } else if (nsegs == ATA_MAX_SEGS) {
+            break;
+        } else {
+            segs[nsegs].buffer = r->buffer;
+            segs[nsegs].count = r->count;
+            nsegs++;
+        }
+        *link = r->next;
+        r->next = NULL;
+        *tail = r;
+        tail = &r->next;
+        end += r->count;
+        total += r->count;
+        if (r != first) {
+            stats.merged++;
+        }
+    }
+    head_lba = end;
+    dispatches++;
+    stats.commands++;
+    if (ata_transfer_async(first->lba, segs, nsegs, first->write, blk_complete, NULL) != 0) {
+        failed = active;
+        active = NULL;
+        return failed;
+    }
+    return NULL;
+}
+
+// ATA completion: start the next command straight away so the drive
+// stays busy, then run the callbacks of the one that finished
+static void blk_complete(int status, void *arg) {
+    struct blk_request *done;
+    struct blk_request *failed;
+    uint32_t flags = spin_lock_irqsave(&blk_lock);
+    (void)arg;
+    done = active;
+    active = NULL;
+    if (done != NULL && done->flush) {
+        blk_release_held();
+    }
+    // Someone may be waiting on a request stuck behind a plug
+    failed = blk_dispatch(waiters > 0);
+    spin_unlock_irqrestore(&blk_lock, flags);
+    blk_finish(done, status);
+    blk_finish(failed, -1);
+}
+
+int blk_init(void) {
+    if (req_cache == NULL) {
+        req_cache = kmem_cache_create("blkreq", sizeof(struct blk_request));
+    }
+    return req_cache != NULL ? 0 : -1;
+}
+
+int blk_submit(uint32_t lba, void *buffer, uint32_t count, int write,
+               blk_done_fn done, void *arg) {
+    struct blk_request *r;
+    struct blk_request *failed;
+    uint32_t flags;
+
+    if (count == 0 || count > BLK_MAX_SECTORS || (req_cache == NULL && blk_init() != 0)) {
+        return -1;
+    }
+    r = kmem_cache_alloc(req_cache);
+    if (r == NULL) {
+        return -1;
+    }
+    r->lba = lba;
+    r->count = count;
+    r->buffer = buffer;
+    r->write = write;
+    r->flush = 0;
+    r->done = done;
+    r->arg = arg;
+
+    flags = spin_lock_irqsave(&blk_lock);
+    if (flushes != NULL || (active != NULL && active->flush)) {
+        r->next = NULL;
+        *held_tail = r;
+        held_tail = &r->next;
+    } else {
+        blk_insert(r);
+    }
+    stats.requests++;
+    failed = blk_dispatch(0);
+    spin_unlock_irqrestore(&blk_lock, flags);
+    blk_finish(failed, -1);
+    return 0;
+}
+
+int blk_submit_flush(blk_done_fn done, void *arg) {
+    struct blk_request *r;
+    struct blk_request **link;
+    struct blk_request *failed;
+    uint32_t flags;
+
+    if (req_cache == NULL && blk_init() != 0) {
+        return -1;
+    }
+    r = kmem_cache_alloc(req_cache);
+    if (r == NULL) {
+        return -1;
+    }
+    r->lba = 0;
+    r->count = 0;
+    r->buffer = NULL;
+    r->write = 0;
+    r->flush = 1;
+    r->done = done;
+    r->arg = arg;
+    r->next = NULL;
+
+    flags = spin_lock_irqsave(&blk_lock);
+    for (link = &flushes; *link != NULL; link = &(*link)->next) {
+    }
+    *link = r;
+    stats.requests++;
+    failed = blk_dispatch(0);
+    spin_unlock_irqrestore(&blk_lock, flags);
+    blk_finish(failed, -1);
+    return 0;
+}
+
+void blk_plug(void) {
+    uint32_t flags = spin_lock_irqsave(&blk_lock);
+    plugged++;
+    spin_unlock_irqrestore(&blk_lock, flags);
+}
+
+void blk_unplug(void) {
+    struct blk_request *failed = NULL;
+    uint32_t flags = spin_lock_irqsave(&blk_lock);
+    if (plugged > 0 && --plugged == 0) {
+        failed = blk_dispatch(0);
+    }
+    spin_unlock_irqrestore(&blk_lock, flags);
+    blk_finish(failed, -1);
+}
+
+void blk_wait(volatile uint32_t *word, uint32_t mask) {
+    struct blk_request *failed;
+    uint32_t flags = spin_lock_irqsave(&blk_lock);
+    waiters++;
+    failed = blk_dispatch(1);
+    spin_unlock_irqrestore(&blk_lock, flags);
+    blk_finish(failed, -1);
+
+    // blk_finish() clears the bits before wake_up() takes the queue lock,
+    // so checking under that lock cannot miss the wakeup
+    flags = spin_lock_irqsave(&blk_waitq.lock);
+    while (*word & mask) {
+        if ((flags & 0x200) && sched_can_sleep()) {
+            sleep_on(&blk_waitq);
+            continue;
+        }
+        spin_unlock(&blk_waitq.lock);
+        if (!(flags & 0x200)) {
+            ata_poll();
+        } else {
+            // sti;hlt is atomic with respect to the wakeup: the IRQ can
+            // only land once hlt has started
+            asm volatile("sti\n"
+                         "hlt\n"
+                         "cli" : : : "memory");
+        }
+        spin_lock(&blk_waitq.lock);
+    }
+    spin_unlock_irqrestore(&blk_waitq.lock, flags);
+
+    flags = spin_lock_irqsave(&blk_lock);
+    waiters--;
+    spin_unlock_irqrestore(&blk_lock, flags);
+}
+
+struct blk_sync {
+    volatile uint32_t busy;
+    int status;
+};
+
+static void blk_wake(int status, void *arg) {
+    struct blk_sync *s = arg;
+    s->status = status;
+    s->busy = 0;
+}
+
+static int blk_rw(uint32_t lba, void *buffer, uint32_t count, int write) {
+    struct blk_sync s = { 0, 0 };
+    uint32_t done = 0;
+    uint32_t n;
+    // Oversized requests are split; the pieces get merged again anyway
+    while (done < count) {
+        n = count - done;
+        if (n > BLK_MAX_SECTORS) {
+            n = BLK_MAX_SECTORS;
+        }
+        s.busy = 1;
+        if (blk_submit(lba + done, (uint8_t*)buffer + 512 * done, n, write, blk_wake, &s) != 0) {
+            return -1;
+        }
+        blk_wait(&s.busy, 1);
+        if (s.status != 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+int blk_read(uint32_t lba, void *buffer, uint32_t count) {
+    return blk_rw(lba, buffer, count, 0);
+}
+
+int blk_write(uint32_t lba, const void *buffer, uint32_t count) {
+    return blk_rw(lba, (void*)buffer, count, 1);
+}
+
+int blk_flush(void) {
+    struct blk_sync s = { 1, 0 };
+    if (blk_submit_flush(blk_wake, &s) != 0) {
+        return -1;
+    }
+    blk_wait(&s.busy, 1);
+    return s.status;
+}
+
+void get_blk_stats(struct blk_stats *out) {
+    *out = stats;
+}
@@ -0,0 +1,52 @@
+#ifndef __BLK_H__
+#define __BLK_H__
+
+#include <stdint.h>
+
+// Block request queue between the block cache and the ATA driver.
+// Requests are kept sorted by LBA and dispatched by a one-way elevator;
+// requests that continue each other on disk go out as one command.
+
+#define BLK_MAX_SECTORS 512     // largest merged command
+#define BLK_DEADLINE    8       // commands a request may be passed over for
+
+// Completion callback, run from the disk interrupt: status is 0 or -1
+typedef void (*blk_done_fn)(int status, void *arg);
+
+struct blk_stats {
+    unsigned int requests;      // submitted
+    unsigned int merged;        // folded into another request's command
+    unsigned int commands;      // sent to the drive
+};
+
+int blk_init(void);
+
+// Queue a transfer of count sectors; done(status, arg) runs when it ends
+// @return 0 if queued, -1 on bad arguments or no memory
+int blk_submit(uint32_t lba, void *buffer, uint32_t count, int write,
+               blk_done_fn done, void *arg);
+
+// While plugged, requests only queue up so that a batch can be sorted
+// and merged before any of it is sent. Plugs nest.
+void blk_plug(void);
+void blk_unplug(void);
+
+// Wait until the bits in mask are clear in *word, sending anything still
+// plugged. Blocks the calling thread, halts when there is no thread to
+// block, or drives the disk by polling when interrupts are off.
+void blk_wait(volatile uint32_t *word, uint32_t mask);
+
+// Queue a barrier that flushes the drive's write cache. It is sent once
+// every request submitted before it has completed; requests submitted
+// after it are held back until the flush is done.
+// @return 0 if queued, -1 on no memory
+int blk_submit_flush(blk_done_fn done, void *arg);
+
+// Synchronous helpers built on blk_submit
+int blk_read(uint32_t lba, void *buffer, uint32_t count);
+int blk_write(uint32_t lba, const void *buffer, uint32_t count);
+int blk_flush(void);
+
+void get_blk_stats(struct blk_stats *stats);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef __CPU_H__
+#define __CPU_H__
+
+#include <stdint.h>
+
+#define MAX_CPUS 8
+#define CACHE_LINE_SIZE 64
+
+// CPUID leaf 1 EDX feature bits
+#define CPUID_FEAT_EDX_PSE  (1 << 3)
+#define CPUID_FEAT_EDX_TSC  (1 << 4)
+#define CPUID_FEAT_EDX_APIC (1 << 9)
+#define CPUID_FEAT_EDX_PGE  (1 << 13)
+
+struct cpu_info {
+    uint8_t apic_id;
+    volatile uint8_t online;
+};
+
+// Processors from the MADT; index 0 is the boot CPU
+extern struct cpu_info cpus[MAX_CPUS];
+extern unsigned int num_cpus;
+
+// Set up by apic_init(); until then everything runs as CPU 0
+extern volatile uint32_t *lapic;
+extern uint8_t apic_cpu[256];
+
+// Index of the CPU we are running on, from the local APIC ID register.
+// Only stable while interrupts are off.
+static inline unsigned int cpu_id(void) {
+    if (lapic == 0) {
+        return 0;
+    }
+    return apic_cpu[lapic[0x20 / 4] >> 24];
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d) {
+    asm volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline int cpu_has_feature(uint32_t edx_bit) {
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+    return (d & edx_bit) != 0;
+}
+
+#endif
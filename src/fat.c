@@ -1,6 +1,11 @@
 #include "fat.h"
-#include "ide.h"
+#include "bcache.h"
+#include "blk.h"
 #include "rprintf.h"
+#include "heap.h"
+#include "vmem.h"
+#include "spinlock.h"
+#include "sched.h"
 #include <stdint.h>
 
 // External printf function
@@ -9,6 +14,17 @@ extern void esp_printf(const func_ptr f_ptr, charptr ctrl, ...);
 
 #define rprintf(...) esp_printf(putc, __VA_ARGS__)
 
+// Dentry cache: recently resolved (directory, name) pairs, including
+// names known not to exist
+#define DCACHE_SIZE  128
+#define DCACHE_NHASH 64         // must be a power of two
+
+// Read-ahead window bounds. The window starts small, doubles each time
+// the reader catches up with it, and never claims more than a quarter
+// of the block cache.
+#define RA_MIN_CLUSTERS 2
+#define RA_MAX_SECTORS  (BCACHE_NBUF / 4)
+
 // Helper functions
 static int strcmp(const char* s1, const char* s2);
 static int strncmp(const char* s1, const char* s2, uint32_t n);
@@ -16,24 +32,84 @@ static char toupper(char c);
 static void* memcpy(void* dest, const void* src, uint32_t n);
 static void* memset(void* s, int c, uint32_t n);
 
+static int dcache_init(void);
+static int fat_flush(void);
+static int fat_sync(void);
+static void fat_close(struct file* fh);
+static uint16_t get_next_cluster(uint16_t cluster);
+static uint32_t cluster_to_sector(uint32_t cluster);
+
 // Global variables
 static struct boot_sector* bs;
 static char bootSector[512];
-static char fat_table[8 * SECTOR_SIZE];
+// Whole-FAT cache: a demand-zero region sized from num_sectors_per_fat,
+// filled one sector at a time the first time a lookup lands in it
+static uint8_t* fat_table;
+static uint8_t* fat_loaded;         // bitmap of FAT sectors already read
+static uint8_t* fat_dirty;          // bitmap of FAT sectors changed since the last flush
+static uint32_t fat_copies;         // num_fat_tables: every copy gets the updates
+static uint32_t fat_num_clusters;   // highest valid cluster number + 1
+static int fat12;
+static uint32_t fat_start_sector;
+static uint32_t fat_num_sectors;
 static uint32_t root_sector;
+static uint32_t root_dir_sectors;
 static uint32_t data_start_sector;
 static uint32_t partition_offset = 2048; // Partition starts at sector 2048
+static struct kmem_cache* file_cache;
+static struct kmem_cache* inode_cache;
+static struct fat_inode* open_inodes;   // every file some handle has open
+static uint32_t num_open_files;
+static spinlock_t files_lock = SPINLOCK_INIT;
+// Serialises the fat* entry points, which sleep on disk I/O: everything
+// else in this file (bounce buffer, dentry cache, FAT table, inodes'
+// extent maps) is only touched with it held. files_lock still guards
+// reference counts, which fatDup changes without it.
+static struct mutex fat_lock = MUTEX_INIT;
+
+struct dentry {
+    struct dentry* hash_next;
+    struct dentry* lru_next;        // towards least recently used
+    struct dentry* lru_prev;
+    uint32_t parent;                // directory cluster, 0 for the root
+    char name[11];                  // 8.3, space padded
+    uint8_t in_use;
+    uint8_t negative;               // the name is known not to exist
+    uint32_t sector;                // where the entry lives on disk
+    uint32_t index;
+    struct root_directory_entry rde;
+};
+
+static struct dentry* dentries;
+static struct dentry* dentry_hash[DCACHE_NHASH];
+static struct dentry* dentry_lru_head;
+static struct dentry* dentry_lru_tail;
+static struct {
+    uint32_t hits;
+    uint32_t misses;
+} dcache_stats;
+static uint32_t bytes_per_cluster;
+static uint8_t* cluster_buffer;     // bounce buffer for partial cluster reads
+static uint16_t bounce_cluster;     // cluster held in cluster_buffer, 0 if none
 
 // Initialize FAT filesystem
-int fatInit(void) {
+static int fat_init(void) {
+    // Don't lose allocations or open files' directory entries from the
+    // previous mount: if they can't be written, keep that mount as is
+    if (fat_table && fat_sync() != 0) {
+        rprintf("Error: Failed to sync the previous mount\r\n");
+        return -1;
+    }
+    if (bcache_init() != 0) {
+        rprintf("Error: Failed to set up block cache\r\n");
+        return -1;
+    }
+    
     // Read boot sector from partition
-    int ret = ata_lba_read(partition_offset, (unsigned char*)bootSector, 1);
-rprintf("ata_lba_read returned: %d\r\n", ret);
-
-if (ret != 0) {
-    rprintf("Error: Failed to read boot sector\r\n");
-    return -1;
-}
+    if (bcache_read(partition_offset, bootSector, 1) != 0) {
+        rprintf("Error: Failed to read boot sector\r\n");
+        return -1;
+    }
     
     bs = (struct boot_sector*)bootSector;
     
@@ -62,15 +138,27 @@ if (ret != 0) {
     rprintf("  Root dir entries: %d\r\n", bs->num_root_dir_entries);
     rprintf("  Sectors per FAT: %d\r\n", bs->num_sectors_per_fat);
     
-    // Read FAT table
-    uint32_t fat_sector = partition_offset + bs->num_reserved_sectors;
-    uint32_t fat_size = bs->num_sectors_per_fat;
-    if (fat_size > 8) {
-        fat_size = 8; // Limit to our buffer size
+    // Set up the FAT cache (drop the one from a previous fatInit)
+    if (fat_table) {
+        vm_release(fat_table);
+        kfree(fat_loaded);
+        kfree(fat_dirty);
     }
-    
-    if (ata_lba_read(fat_sector, (unsigned char*)fat_table, fat_size) != 0) {
-        rprintf("Error: Failed to read FAT table\r\n");
+    fat12 = strncmp(bs->fs_type, "FAT12", 5) == 0;
+    fat_start_sector = partition_offset + bs->num_reserved_sectors;
+    fat_num_sectors = bs->num_sectors_per_fat;
+    fat_copies = bs->num_fat_tables;
+    fat_table = vm_reserve(fat_num_sectors * SECTOR_SIZE);
+    fat_loaded = kzalloc((fat_num_sectors + 7) / 8);
+    fat_dirty = kzalloc((fat_num_sectors + 7) / 8);
+    if (!fat_table || !fat_loaded || !fat_dirty) {
+        rprintf("Error: Failed to allocate FAT cache\r\n");
+        if (fat_table) vm_release(fat_table);
+        kfree(fat_loaded);
+        kfree(fat_dirty);
+        fat_table = 0;
+        fat_loaded = 0;
+        fat_dirty = 0;
         return -1;
     }
     
@@ -79,10 +167,50 @@ if (ret != 0) {
                   (bs->num_fat_tables * bs->num_sectors_per_fat);
     
     // Calculate data region start
-    uint32_t root_dir_sectors = ((bs->num_root_dir_entries * 32) + 
-                                 (bs->bytes_per_sector - 1)) / bs->bytes_per_sector;
+    root_dir_sectors = ((bs->num_root_dir_entries * 32) + 
+                        (bs->bytes_per_sector - 1)) / bs->bytes_per_sector;
     data_start_sector = root_sector + root_dir_sectors;
     
+    // Clusters that exist both in the data region and in the FAT
+    uint32_t total_sectors = bs->total_sectors ? bs->total_sectors : bs->total_sectors_in_fs;
+    uint32_t fat_entries = fat12 ? fat_num_sectors * SECTOR_SIZE * 2 / 3
+                                 : fat_num_sectors * SECTOR_SIZE / 2;
+    fat_num_clusters = (total_sectors - (data_start_sector - partition_offset)) /
+                       bs->num_sectors_per_cluster + 2;
+    if (fat_num_clusters > fat_entries) {
+        fat_num_clusters = fat_entries;
+    }
+    
+    // Bounce buffer for partial cluster reads
+    bytes_per_cluster = bs->bytes_per_sector * bs->num_sectors_per_cluster;
+    kfree(cluster_buffer);
+    cluster_buffer = kmalloc(bytes_per_cluster);
+    bounce_cluster = 0;
+    if (!cluster_buffer) {
+        rprintf("Error: Failed to allocate cluster buffer\r\n");
+        return -1;
+    }
+    
+    if (dcache_init() != 0) {
+        rprintf("Error: Failed to allocate dentry cache\r\n");
+        return -1;
+    }
+    
+    if (!file_cache) {
+        file_cache = kmem_cache_create("file", sizeof(struct file));
+        if (!file_cache) {
+            rprintf("Error: Failed to create file cache\r\n");
+            return -1;
+        }
+    }
+    if (!inode_cache) {
+        inode_cache = kmem_cache_create("fat_inode", sizeof(struct fat_inode));
+        if (!inode_cache) {
+            rprintf("Error: Failed to create inode cache\r\n");
+            return -1;
+        }
+    }
+    
     rprintf("  Root sector: %d\r\n", root_sector);
     rprintf("  Data start sector: %d\r\n", data_start_sector);
     
@@ -118,172 +246,1305 @@ static void extract_filename(struct root_directory_entry *rde, char *fname) {
     fname[k] = '\0';
 }
 
-// Open a file
-struct file* fatOpen(const char* filename) {
-    static struct file fh;
-    static char root_dir_buffer[SECTOR_SIZE];
-    
-    // Convert filename to uppercase and parse
-    char name[9] = {0};
-    char ext[4] = {0};
-    int name_idx = 0, ext_idx = 0;
+// Convert one path component to a space-padded 8.3 name
+static int fat_make_name(const char* comp, uint32_t len, char* name) {
+    uint32_t i;
+    int n = 0;
+    int e = 8;
     int in_ext = 0;
     
-    for (int i = 0; filename[i] != '\0' && i < 256; i++) {
-        if (filename[i] == '.') {
+    for (i = 0; i < 11; i++) {
+        name[i] = ' ';
+    }
+    // "." and ".." are stored literally
+    if ((len == 1 && comp[0] == '.') || (len == 2 && comp[0] == '.' && comp[1] == '.')) {
+        for (i = 0; i < len; i++) {
+            name[i] = '.';
+        }
+        return 0;
+    }
+    for (i = 0; i < len; i++) {
+        if (comp[i] == '.' && !in_ext) {
             in_ext = 1;
-            continue;
+        } else if (in_ext && e < 11) {
+            name[e++] = toupper(comp[i]);
+        } else if (!in_ext && n < 8) {
+            name[n++] = toupper(comp[i]);
         }
-        if (filename[i] == '/' || filename[i] == '\\') {
-            continue;
+    }
+    return n > 0 ? 0 : -1;
+}
+
+static uint32_t dcache_hash(uint32_t parent, const char* name) {
+    uint32_t h = 2166136261u ^ parent;      // FNV-1a
+    int i;
+    for (i = 0; i < 11; i++) {
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return h & (DCACHE_NHASH - 1);
+}
+
+static void dentry_lru_unlink(struct dentry* d) {
+    if (d->lru_prev) {
+        d->lru_prev->lru_next = d->lru_next;
+    } else {
+        dentry_lru_head = d->lru_next;
+    }
+    if (d->lru_next) {
+        d->lru_next->lru_prev = d->lru_prev;
+    } else {
+        dentry_lru_tail = d->lru_prev;
+    }
+}
+
+static void dentry_lru_push_front(struct dentry* d) {
+    d->lru_prev = 0;
+    d->lru_next = dentry_lru_head;
+    if (dentry_lru_head) {
+        dentry_lru_head->lru_prev = d;
+    } else {
+        dentry_lru_tail = d;
+    }
+    dentry_lru_head = d;
+}
+
+static void dentry_hash_remove(struct dentry* d) {
+    struct dentry** link = &dentry_hash[dcache_hash(d->parent, d->name)];
+    while (*link && *link != d) {
+        link = &(*link)->hash_next;
+    }
+    if (*link) {
+        *link = d->hash_next;
+    }
+    d->hash_next = 0;
+}
+
+// Set up the dentry pool, or forget everything in it on a re-init
+static int dcache_init(void) {
+    int i;
+    if (!dentries) {
+        dentries = kzalloc(DCACHE_SIZE * sizeof(struct dentry));
+        if (!dentries) {
+            return -1;
         }
-        
-        if (in_ext && ext_idx < 3) {
-            ext[ext_idx++] = toupper(filename[i]);
-        } else if (!in_ext && name_idx < 8) {
-            name[name_idx++] = toupper(filename[i]);
+    }
+    dentry_lru_head = 0;
+    dentry_lru_tail = 0;
+    for (i = 0; i < DCACHE_NHASH; i++) {
+        dentry_hash[i] = 0;
+    }
+    for (i = 0; i < DCACHE_SIZE; i++) {
+        dentries[i].in_use = 0;
+        dentries[i].hash_next = 0;
+        dentry_lru_push_front(&dentries[i]);
+    }
+    return 0;
+}
+
+static struct dentry* dcache_lookup(uint32_t parent, const char* name) {
+    struct dentry* d = dentry_hash[dcache_hash(parent, name)];
+    while (d && (d->parent != parent || strncmp(d->name, name, 11) != 0)) {
+        d = d->hash_next;
+    }
+    if (d) {
+        dentry_lru_unlink(d);
+        dentry_lru_push_front(d);
+    }
+    return d;
+}
+
+// Remember a lookup result (rde == 0 for a negative entry), recycling
+// the least recently used dentry
+static struct dentry* dcache_insert(uint32_t parent, const char* name,
+                                    const struct root_directory_entry* rde,
+                                    uint32_t sector, uint32_t index) {
+    struct dentry* d = dentry_lru_tail;
+    uint32_t h;
+    if (d->in_use) {
+        dentry_hash_remove(d);
+    }
+    d->parent = parent;
+    memcpy(d->name, name, 11);
+    d->in_use = 1;
+    d->negative = rde == 0;
+    if (rde) {
+        memcpy(&d->rde, rde, sizeof(struct root_directory_entry));
+        d->sector = sector;
+        d->index = index;
+    }
+    h = dcache_hash(parent, name);
+    d->hash_next = dentry_hash[h];
+    dentry_hash[h] = d;
+    dentry_lru_unlink(d);
+    dentry_lru_push_front(d);
+    return d;
+}
+
+// Sector n of directory 'dir' (a cluster, 0 for the fixed root
+// directory), or 0 past its end. *cluster tracks the chain position
+// between calls with increasing n.
+static uint32_t fat_dir_sector(uint32_t dir, uint32_t n, uint16_t* cluster) {
+    uint32_t spc = bs->num_sectors_per_cluster;
+    if (dir == 0) {
+        return n < root_dir_sectors ? root_sector + n : 0;
+    }
+    if (n == 0) {
+        *cluster = dir;
+    } else if (n % spc == 0) {
+        *cluster = get_next_cluster(*cluster);
+    }
+    if (*cluster < 2 || *cluster == 0xFFFF) {
+        return 0;
+    }
+    return cluster_to_sector(*cluster) + n % spc;
+}
+
+// Scan directory 'dir' for an 8.3 name. Returns 0 and fills *out,
+// -1 if the name does not exist, -2 on a read error.
+static int fat_dir_scan(uint32_t dir, const char* name, struct root_directory_entry* out,
+                        uint32_t* sector, uint32_t* index) {
+    uint32_t entries_per_sector = SECTOR_SIZE / sizeof(struct root_directory_entry);
+    uint16_t cluster = 0;
+    uint32_t lba;
+    uint32_t n;
+    uint32_t i;
+    
+    for (n = 0; (lba = fat_dir_sector(dir, n, &cluster)) != 0; n++) {
+        struct buf* b = bread(lba);
+        if (!b) {
+            rprintf("Error: Failed to read directory sector %d\r\n", lba);
+            return -2;
+        }
+        struct root_directory_entry* entries = (struct root_directory_entry*)b->data;
+        for (i = 0; i < entries_per_sector; i++) {
+            // End of directory
+            if (entries[i].file_name[0] == 0x00) {
+                brelse(b);
+                return -1;
+            }
+            // Skip deleted entries, volume labels and long-name pieces
+            if ((uint8_t)entries[i].file_name[0] == 0xE5 || (entries[i].attribute & 0x08)) {
+                continue;
+            }
+            if (strncmp(entries[i].file_name, name, 11) == 0) {
+                memcpy(out, &entries[i], sizeof(struct root_directory_entry));
+                *sector = lba;
+                *index = i;
+                brelse(b);
+                return 0;
+            }
+        }
+        brelse(b);
+    }
+    return -1;
+}
+
+// Resolve one name in directory 'dir' through the dentry cache
+static struct dentry* fat_lookup(uint32_t dir, const char* name) {
+    struct root_directory_entry rde;
+    uint32_t sector;
+    uint32_t index;
+    int r;
+    struct dentry* d = dcache_lookup(dir, name);
+    
+    if (d) {
+        dcache_stats.hits++;
+        return d;
+    }
+    dcache_stats.misses++;
+    r = fat_dir_scan(dir, name, &rde, &sector, &index);
+    if (r == -2) {
+        return 0;   // don't cache I/O errors as missing names
+    }
+    return dcache_insert(dir, name, r == 0 ? &rde : 0, sector, index);
+}
+
+// Walk a '/' or '\\' separated path from the root directory. Every
+// component but the last has to be a directory.
+static struct dentry* fat_lookup_path(const char* path) {
+    struct dentry* d = 0;
+    uint32_t dir = 0;
+    uint32_t len;
+    char name[11];
+    
+    for (;;) {
+        while (*path == '/' || *path == '\\') {
+            path++;
+        }
+        if (*path == '\0') {
+            return d;
+        }
+        if (d && !(d->rde.attribute & FILE_ATTRIBUTE_SUBDIRECTORY)) {
+            return 0;
+        }
+        for (len = 0; path[len] && path[len] != '/' && path[len] != '\\'; len++) {
         }
+        if (fat_make_name(path, len, name) != 0) {
+            return 0;
+        }
+        d = fat_lookup(dir, name);
+        if (!d || d->negative) {
+            return 0;
+        }
+        dir = d->rde.cluster;
+        path += len;
+    }
+}
+
+// Open inode for the directory entry at (sector, index), or 0.
+// files_lock held.
+static struct fat_inode* fat_inode_find(uint32_t sector, uint32_t index) {
+    struct fat_inode* ip;
+    for (ip = open_inodes; ip; ip = ip->next) {
+        if (ip->dirent_sector == sector && ip->dirent_index == index) {
+            return ip;
+        }
+    }
+    return 0;
+}
+
+// Take a reference to the inode of dentry 'd', setting one up from the
+// directory entry if no handle has the file open yet. An inode already
+// open is used as is: its size and chain are newer than the dentry's.
+static struct fat_inode* fat_iget(struct dentry* d) {
+    struct fat_inode* ip;
+    struct fat_inode* fresh;
+    uint32_t flags;
+    
+    flags = spin_lock_irqsave(&files_lock);
+    ip = fat_inode_find(d->sector, d->index);
+    if (ip) {
+        ip->refcnt++;
+        spin_unlock_irqrestore(&files_lock, flags);
+        return ip;
     }
+    spin_unlock_irqrestore(&files_lock, flags);
     
-    // Pad with spaces
-    while (name_idx < 8) name[name_idx++] = ' ';
-    while (ext_idx < 3) ext[ext_idx++] = ' ';
+    fresh = kmem_cache_alloc(inode_cache);
+    if (!fresh) {
+        return 0;
+    }
+    memcpy(&fresh->rde, &d->rde, sizeof(struct root_directory_entry));
+    fresh->refcnt = 1;
+    fresh->start_cluster = d->rde.cluster;
+    fresh->extents = 0;
+    fresh->num_extents = 0;
+    fresh->max_extents = 0;
+    fresh->mapped_clusters = 0;
+    fresh->next_unmapped = d->rde.cluster >= 2 ? d->rde.cluster : 0xFFFF;
+    fresh->dir_cluster = d->parent;
+    fresh->dirent_sector = d->sector;
+    fresh->dirent_index = d->index;
+    fresh->dirty = 0;
     
-    rprintf("Looking for file: '%.8s.%.3s'\r\n", name, ext);
+    // Someone may have opened the file while we were allocating
+    flags = spin_lock_irqsave(&files_lock);
+    ip = fat_inode_find(d->sector, d->index);
+    if (ip) {
+        ip->refcnt++;
+        spin_unlock_irqrestore(&files_lock, flags);
+        kmem_cache_free(inode_cache, fresh);
+        return ip;
+    }
+    fresh->prev = 0;
+    fresh->next = open_inodes;
+    if (open_inodes) {
+        open_inodes->prev = fresh;
+    }
+    open_inodes = fresh;
+    spin_unlock_irqrestore(&files_lock, flags);
+    return fresh;
+}
+
+// Open a file by path, e.g. "testfile.txt" or "/boot/grub/grub.cfg"
+static struct file* fat_open(const char* filename) {
+    struct file* fh;
+    struct fat_inode* ip;
+    struct dentry* d;
+    char temp_name[16];
     
-    // Calculate number of sectors in root directory
-    uint32_t root_dir_sectors = ((bs->num_root_dir_entries * 32) + 
-                                 (bs->bytes_per_sector - 1)) / bs->bytes_per_sector;
+    rprintf("Looking for file: '%s'\r\n", filename);
     
-    // Search root directory
-    for (uint32_t sector = 0; sector < root_dir_sectors; sector++) {
-        if (ata_lba_read(root_sector + sector, (unsigned char*)root_dir_buffer, 1) != 0) {
-            rprintf("Error: Failed to read root directory sector %d\r\n", sector);
-            return 0;
+    d = fat_lookup_path(filename);
+    if (!d) {
+        rprintf("Error: File not found\r\n");
+        return 0;
+    }
+    if (d->rde.attribute & FILE_ATTRIBUTE_SUBDIRECTORY) {
+        rprintf("Error: '%s' is a directory\r\n", filename);
+        return 0;
+    }
+    
+    // Initialize file handle
+    fh = kmem_cache_alloc(file_cache);
+    if (!fh) {
+        rprintf("Error: Out of memory for file handle\r\n");
+        return 0;
+    }
+    ip = fat_iget(d);
+    if (!ip) {
+        rprintf("Error: Out of memory for file handle\r\n");
+        kmem_cache_free(file_cache, fh);
+        return 0;
+    }
+    
+    extract_filename(&ip->rde, temp_name);
+    rprintf("Found file: %s\r\n", temp_name);
+    rprintf("  Size: %d bytes\r\n", ip->rde.file_size);
+    rprintf("  Cluster: %d\r\n", ip->start_cluster);
+    
+    fh->refcnt = 1;
+    fh->inode = ip;
+    fh->position = 0;
+    fh->current_cluster = ip->start_cluster;
+    fh->ra_prev_end = 0;
+    fh->ra_pos = 0;
+    fh->ra_window = 0;
+    
+    uint32_t flags = spin_lock_irqsave(&files_lock);
+    num_open_files++;
+    spin_unlock_irqrestore(&files_lock, flags);
+    
+    return fh;
+}
+
+// Make sure the FAT sector holding byte 'offset' is in the cache
+static int fat_load_sector(uint32_t offset) {
+    uint32_t sector = offset / SECTOR_SIZE;
+    if (sector >= fat_num_sectors) {
+        return -1;
+    }
+    if (fat_loaded[sector / 8] & (1 << (sector % 8))) {
+        return 0;
+    }
+    if (bcache_read(fat_start_sector + sector, fat_table + sector * SECTOR_SIZE, 1) != 0) {
+        rprintf("Error: Failed to read FAT sector %d\r\n", sector);
+        return -1;
+    }
+    fat_loaded[sector / 8] |= 1 << (sector % 8);
+    return 0;
+}
+
+// Raw FAT entry for a cluster, 0xFFFF if its FAT sector can't be read
+static uint16_t fat_get_entry(uint16_t cluster) {
+    if (fat12) {
+        // FAT12: 1.5 bytes per entry, which may straddle two sectors
+        uint32_t fat_offset = cluster + (cluster / 2);
+        if (fat_load_sector(fat_offset) != 0 || fat_load_sector(fat_offset + 1) != 0) {
+            return 0xFFFF;
         }
-        
-        struct root_directory_entry* entries = (struct root_directory_entry*)root_dir_buffer;
-        uint32_t entries_per_sector = SECTOR_SIZE / sizeof(struct root_directory_entry);
-        
-        for (uint32_t i = 0; i < entries_per_sector; i++) {
-            // Check for end of directory
-            if (entries[i].file_name[0] == 0x00) {
-                rprintf("Error: File not found (end of directory)\r\n");
-                return 0;
+        uint16_t entry = fat_table[fat_offset] | (fat_table[fat_offset + 1] << 8);
+        return (cluster & 1) ? entry >> 4 : entry & 0x0FFF;
+    }
+    // FAT16: 2 bytes per entry
+    uint32_t fat_offset = cluster * 2;
+    if (fat_load_sector(fat_offset) != 0) {
+        return 0xFFFF;
+    }
+    return *(uint16_t*)(fat_table + fat_offset);
+}
+
+// Change a FAT entry in the cache; fat_flush writes it out later
+static int fat_set_entry(uint16_t cluster, uint16_t value) {
+    uint32_t fat_offset;
+    uint32_t sector;
+    
+    if (fat12) {
+        fat_offset = cluster + (cluster / 2);
+        if (fat_load_sector(fat_offset) != 0 || fat_load_sector(fat_offset + 1) != 0) {
+            return -1;
+        }
+        uint16_t entry = fat_table[fat_offset] | (fat_table[fat_offset + 1] << 8);
+        if (cluster & 1) {
+            entry = (entry & 0x000F) | (value << 4);
+        } else {
+            entry = (entry & 0xF000) | (value & 0x0FFF);
+        }
+        fat_table[fat_offset] = entry & 0xFF;
+        fat_table[fat_offset + 1] = entry >> 8;
+        sector = (fat_offset + 1) / SECTOR_SIZE;
+        fat_dirty[sector / 8] |= 1 << (sector % 8);
+    } else {
+        fat_offset = cluster * 2;
+        if (fat_load_sector(fat_offset) != 0) {
+            return -1;
+        }
+        *(uint16_t*)(fat_table + fat_offset) = value;
+    }
+    sector = fat_offset / SECTOR_SIZE;
+    fat_dirty[sector / 8] |= 1 << (sector % 8);
+    return 0;
+}
+
+// Get next cluster from FAT
+static uint16_t get_next_cluster(uint16_t cluster) {
+    uint16_t entry = fat_get_entry(cluster);
+    if (entry >= (fat12 ? 0xFF8 : 0xFFF8)) {
+        return 0xFFFF; // End of chain
+    }
+    return entry;
+}
+
+// Write the dirty FAT sectors to every FAT copy. Consecutive dirty
+// sectors go out as one multi-sector write per copy.
+static int fat_flush(void) {
+    uint32_t s = 0;
+    uint32_t run;
+    uint32_t copy;
+    int ret = 0;
+    int run_ret;
+    
+    while (s < fat_num_sectors) {
+        if (!(fat_dirty[s / 8] & (1 << (s % 8)))) {
+            s++;
+            continue;
+        }
+        run = 1;
+        while (s + run < fat_num_sectors && (fat_dirty[(s + run) / 8] & (1 << ((s + run) % 8)))) {
+            run++;
+        }
+        run_ret = 0;
+        for (copy = 0; copy < fat_copies; copy++) {
+            if (bcache_write(fat_start_sector + copy * fat_num_sectors + s,
+                             fat_table + s * SECTOR_SIZE, run) != 0) {
+                run_ret = -1;
             }
-            
-            // Skip deleted entries
-            if ((uint8_t)entries[i].file_name[0] == 0xE5) {
-                continue;
+        }
+        // A failed run stays dirty for the next sync; the others are done
+        if (run_ret == 0) {
+            for (copy = s; copy < s + run; copy++) {
+                fat_dirty[copy / 8] &= ~(1 << (copy % 8));
             }
-            
-            // Skip volume labels
-            if (entries[i].attribute & 0x08) {
+        } else {
+            ret = -1;
+        }
+        s += run;
+    }
+    return ret;
+}
+
+// Allocate up to 'want' free clusters as one contiguous run and chain
+// them behind 'prev' (0 for a new chain). The run right after prev is
+// preferred so the file stays sequential on disk, then the first free
+// run that is long enough, then the longest one. Returns the first
+// cluster, or 0 if the disk is full; *got is the run length.
+static uint16_t fat_alloc(uint16_t prev, uint32_t want, uint32_t* got) {
+    uint32_t start = 0;
+    uint32_t len = 0;
+    uint32_t run_start = 0;
+    uint32_t run_len = 0;
+    uint32_t c;
+    uint32_t i;
+    uint16_t eoc = fat12 ? 0xFFF : 0xFFFF;
+    
+    if (prev >= 2) {
+        for (c = prev + 1; c < fat_num_clusters && len < want && fat_get_entry(c) == 0; c++) {
+            len++;
+        }
+        start = prev + 1;
+    }
+    if (len == 0) {
+        for (c = 2; c < fat_num_clusters; c++) {
+            if (fat_get_entry(c) != 0) {
+                run_len = 0;
                 continue;
             }
-            
-            // Compare name and extension
-            if (strncmp(entries[i].file_name, name, 8) == 0 &&
-                strncmp(entries[i].file_extension, ext, 3) == 0) {
-                
-                char temp_name[16];
-                extract_filename(&entries[i], temp_name);
-                rprintf("Found file: %s\r\n", temp_name);
-                rprintf("  Size: %d bytes\r\n", entries[i].file_size);
-                rprintf("  Cluster: %d\r\n", entries[i].cluster);
-                
-                // Initialize file handle
-                memcpy(&fh.rde, &entries[i], sizeof(struct root_directory_entry));
-                fh.position = 0;
-                fh.current_cluster = entries[i].cluster;
-                fh.start_cluster = entries[i].cluster;
-                
-                return &fh;
+            if (run_len++ == 0) {
+                run_start = c;
+            }
+            if (run_len > len) {
+                start = run_start;
+                len = run_len;
+                if (len == want) {
+                    break;
+                }
             }
         }
     }
+    if (len == 0) {
+        return 0;
+    }
+    for (i = 0; i < len; i++) {
+        fat_set_entry(start + i, i == len - 1 ? eoc : start + i + 1);
+    }
+    if (prev >= 2) {
+        fat_set_entry(prev, start);
+    }
+    *got = len;
+    return start;
+}
+
+// Return a chain's clusters to the free pool
+static void fat_free_chain(uint16_t cluster) {
+    uint16_t next;
+    while (cluster >= 2 && cluster != 0xFFFF) {
+        next = get_next_cluster(cluster);
+        fat_set_entry(cluster, 0);
+        cluster = next;
+    }
+}
+
+// Convert a data cluster number to its first sector (cluster 2 is the first data cluster)
+static uint32_t cluster_to_sector(uint32_t cluster) {
+    return data_start_sector + ((cluster - 2) * bs->num_sectors_per_cluster);
+}
+
+// Walk the FAT until the extent map covers cluster 'index' of the file,
+// merging each cluster into the last extent when it follows on disk
+static int fat_extend_map(struct fat_inode* ip, uint32_t index) {
+    struct fat_extent* last;
+    struct fat_extent* grown;
+    uint16_t cluster;
     
-    rprintf("Error: File not found\r\n");
+    while (ip->mapped_clusters <= index) {
+        cluster = ip->next_unmapped;
+        if (cluster < 2 || cluster == 0xFFFF) {
+            return -1;  // chain ends before index
+        }
+        last = ip->num_extents ? &ip->extents[ip->num_extents - 1] : 0;
+        if (last && last->start + last->length == cluster) {
+            last->length++;
+        } else {
+            if (ip->num_extents == ip->max_extents) {
+                uint32_t max = ip->max_extents ? ip->max_extents * 2 : 4;
+                grown = kmalloc(max * sizeof(struct fat_extent));
+                if (!grown) {
+                    return -1;
+                }
+                memcpy(grown, ip->extents, ip->num_extents * sizeof(struct fat_extent));
+                kfree(ip->extents);
+                ip->extents = grown;
+                ip->max_extents = max;
+            }
+            last = &ip->extents[ip->num_extents++];
+            last->file_cluster = ip->mapped_clusters;
+            last->start = cluster;
+            last->length = 1;
+        }
+        ip->mapped_clusters++;
+        ip->next_unmapped = get_next_cluster(cluster);
+    }
     return 0;
 }
 
-// Get next cluster from FAT
-static uint16_t get_next_cluster(uint16_t cluster) {
-    if (strncmp(bs->fs_type, "FAT12", 5) == 0) {
-        // FAT12: 1.5 bytes per entry
-        uint32_t fat_offset = cluster + (cluster / 2);
-        uint16_t* fat = (uint16_t*)fat_table;
-        uint16_t entry = fat[fat_offset / 2];
-        
-        if (cluster & 1) {
-            entry >>= 4;
+// Disk cluster holding cluster 'index' of the file, or 0xFFFF past the
+// end of the chain. *run gets the number of clusters from there to the
+// end of its extent, all contiguous on disk.
+static uint16_t fat_map_cluster(struct fat_inode* ip, uint32_t index, uint32_t* run) {
+    uint32_t lo = 0;
+    uint32_t hi;
+    uint32_t mid;
+    struct fat_extent* e;
+    
+    if (fat_extend_map(ip, index) != 0) {
+        return 0xFFFF;
+    }
+    // Binary search for the last extent starting at or before index
+    hi = ip->num_extents - 1;
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (ip->extents[mid].file_cluster <= index) {
+            lo = mid;
         } else {
-            entry &= 0x0FFF;
+            hi = mid - 1;
         }
-        
-        if (entry >= 0xFF8) return 0xFFFF; // End of chain
-        return entry;
-    } else {
-        // FAT16: 2 bytes per entry
-        uint16_t* fat = (uint16_t*)fat_table;
-        uint16_t entry = fat[cluster];
-        
-        if (entry >= 0xFFF8) return 0xFFFF; // End of chain
-        return entry;
     }
+    e = &ip->extents[lo];
+    if (run) {
+        *run = e->file_cluster + e->length - index;
+    }
+    return e->start + (index - e->file_cluster);
+}
+
+// Keep the next ra_window clusters after the read position on their way
+// into the block cache. Called after each read: a read that does not
+// start where the previous one stopped switches read-ahead off; one that
+// does starts it, and widens the window whenever the reader has used up
+// half of what was prefetched.
+static void fat_readahead(struct file* fh, uint32_t start) {
+    uint32_t max_window = RA_MAX_SECTORS / bs->num_sectors_per_cluster;
+    uint32_t cluster_start = fh->position - fh->position % bytes_per_cluster;
+    uint32_t target;
+    uint32_t want;
+    uint32_t run;
+    uint16_t cluster;
+    
+    if (max_window == 0) {
+        max_window = 1;
+    }
+    if (start != fh->ra_prev_end) {
+        // Not sequential: start over from here, not from the old stream
+        fh->ra_window = 0;
+        fh->ra_pos = cluster_start;
+    }
+    fh->ra_prev_end = fh->position;
+    if (fh->position >= fh->inode->rde.file_size) {
+        return;
+    }
+    
+    if (fh->ra_window == 0) {
+        fh->ra_window = RA_MIN_CLUSTERS < max_window ? RA_MIN_CLUSTERS : max_window;
+    } else if (fh->ra_pos > fh->position &&
+               fh->ra_pos - fh->position > fh->ra_window * bytes_per_cluster / 2) {
+        return;     // still well ahead of the reader
+    } else if (fh->ra_window < max_window) {
+        fh->ra_window *= 2;
+        if (fh->ra_window > max_window) {
+            fh->ra_window = max_window;
+        }
+    }
+    if (fh->ra_pos < cluster_start) {
+        fh->ra_pos = cluster_start;     // a big read overtook the prefetch
+    }
+    
+    // One prefetch per extent: each becomes a single disk command
+    target = fh->position + fh->ra_window * bytes_per_cluster;
+    blk_plug();
+    while (fh->ra_pos < target && fh->ra_pos < fh->inode->rde.file_size) {
+        cluster = fat_map_cluster(fh->inode, fh->ra_pos / bytes_per_cluster, &run);
+        if (cluster == 0xFFFF) {
+            break;
+        }
+        want = (target - fh->ra_pos + bytes_per_cluster - 1) / bytes_per_cluster;
+        if (run > want) {
+            run = want;
+        }
+        bcache_prefetch(cluster_to_sector(cluster), run * bs->num_sectors_per_cluster);
+        fh->ra_pos += run * bytes_per_cluster;
+    }
+    blk_unplug();
 }
 
 // Read from file
-int fatRead(struct file* fh, void* buffer, uint32_t size) {
+static int fat_read(struct file* fh, void* buffer, uint32_t size) {
     if (!fh) return -1;
     
     uint32_t bytes_read = 0;
     uint8_t* buf = (uint8_t*)buffer;
-    static char cluster_buffer[SECTOR_SIZE];
+    uint32_t start = fh->position;
     
-    uint32_t bytes_per_cluster = bs->bytes_per_sector * bs->num_sectors_per_cluster;
+    if (fh->position >= fh->inode->rde.file_size) {
+        return 0;
+    }
+    if (size > fh->inode->rde.file_size - fh->position) {
+        size = fh->inode->rde.file_size - fh->position;
+    }
     
-    while (bytes_read < size && fh->position < fh->rde.file_size) {
-        // Calculate position within current cluster
+    while (bytes_read < size) {
         uint32_t cluster_offset = fh->position % bytes_per_cluster;
-        uint32_t bytes_remaining_in_cluster = bytes_per_cluster - cluster_offset;
-        uint32_t bytes_remaining_in_file = fh->rde.file_size - fh->position;
         uint32_t bytes_to_read = size - bytes_read;
+        uint32_t run;
+        uint16_t cluster = fat_map_cluster(fh->inode, fh->position / bytes_per_cluster, &run);
         
-        if (bytes_to_read > bytes_remaining_in_cluster) {
-            bytes_to_read = bytes_remaining_in_cluster;
-        }
-        if (bytes_to_read > bytes_remaining_in_file) {
-            bytes_to_read = bytes_remaining_in_file;
+        if (cluster == 0xFFFF) {
+            break;  // chain is shorter than the directory entry claims
         }
+        fh->current_cluster = cluster;
         
-        // Calculate sector number (cluster 2 is the first data cluster)
-        uint32_t sector = data_start_sector + 
-                         ((fh->current_cluster - 2) * bs->num_sectors_per_cluster);
-        
-        // Read sector
-        if (ata_lba_read(sector, (unsigned char*)cluster_buffer, bs->num_sectors_per_cluster) != 0) {
-            rprintf("Error: Failed to read data cluster\r\n");
-            return -1;
+        if (cluster_offset == 0 && bytes_to_read >= bytes_per_cluster) {
+            // Whole clusters go straight into the caller's buffer, as much
+            // of the extent as fits in one multi-sector read
+            uint32_t max_run = bytes_to_read / bytes_per_cluster;
+            if (run > max_run) {
+                run = max_run;
+            }
+            if (bcache_read(cluster_to_sector(cluster), buf + bytes_read,
+                            run * bs->num_sectors_per_cluster) != 0) {
+                rprintf("Error: Failed to read data clusters\r\n");
+                return -1;
+            }
+            bytes_to_read = run * bytes_per_cluster;
+            fh->current_cluster = cluster + run - 1;
+        } else {
+            // Partial head/tail cluster: bounce through the cluster buffer,
+            // which remembers its cluster so small sequential reads hit it
+            if (bytes_to_read > bytes_per_cluster - cluster_offset) {
+                bytes_to_read = bytes_per_cluster - cluster_offset;
+            }
+            if (bounce_cluster != cluster) {
+                if (bcache_read(cluster_to_sector(cluster), cluster_buffer,
+                                bs->num_sectors_per_cluster) != 0) {
+                    bounce_cluster = 0;
+                    rprintf("Error: Failed to read data cluster\r\n");
+                    return -1;
+                }
+                bounce_cluster = cluster;
+            }
+            memcpy(buf + bytes_read, cluster_buffer + cluster_offset, bytes_to_read);
         }
         
-        // Copy data to buffer
-        memcpy(buf + bytes_read, cluster_buffer + cluster_offset, bytes_to_read);
-        
         bytes_read += bytes_to_read;
         fh->position += bytes_to_read;
+    }
+    
+    fat_readahead(fh, start);
+    return bytes_read;
+}
+
+// Move the read position to 'offset' bytes from the start of the file.
+// The extent map finds the cluster without walking the chain again.
+static int fat_seek(struct file* fh, uint32_t offset) {
+    uint16_t cluster;
+    
+    if (!fh || offset > fh->inode->rde.file_size) {
+        return -1;
+    }
+    fh->position = offset;
+    if (offset < fh->inode->rde.file_size) {
+        cluster = fat_map_cluster(fh->inode, offset / bytes_per_cluster, 0);
+        if (cluster == 0xFFFF) {
+            return -1;
+        }
+        fh->current_cluster = cluster;
+    }
+    return 0;
+}
+
+// Make the file's chain long enough to hold 'end' bytes
+static int fat_reserve(struct fat_inode* ip, uint32_t end) {
+    uint32_t need = (end + bytes_per_cluster - 1) / bytes_per_cluster;
+    uint32_t got;
+    uint16_t prev;
+    uint16_t first;
+    
+    if (need == 0 || fat_map_cluster(ip, need - 1, 0) != 0xFFFF) {
+        return 0;
+    }
+    // The lookup walked the chain to its end, so the map covers all of it
+    if (ip->next_unmapped >= 2 && ip->next_unmapped != 0xFFFF) {
+        return -1;
+    }
+    while (ip->mapped_clusters < need) {
+        prev = ip->mapped_clusters ? fat_map_cluster(ip, ip->mapped_clusters - 1, 0) : 0;
+        first = fat_alloc(prev, need - ip->mapped_clusters, &got);
+        if (!first) {
+            return -1;      // disk full
+        }
+        if (!prev) {
+            ip->start_cluster = first;
+            ip->rde.cluster = first;
+            ip->dirty = 1;
+        }
+        ip->next_unmapped = first;
+        if (fat_extend_map(ip, ip->mapped_clusters + got - 1) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Write at the current position, growing the file as needed. Whole
+// sectors are written through the block cache in one command per
+// extent; partial sectors are merged into their cached copy and left
+// dirty until the next sync.
+static int fat_write(struct file* fh, const void* buffer, uint32_t size) {
+    const uint8_t* src = (const uint8_t*)buffer;
+    uint32_t written = 0;
+    struct fat_inode* ip;
+    
+    if (!fh || fh->position > fh->inode->rde.file_size) {
+        return -1;
+    }
+    if (size == 0) {
+        return 0;
+    }
+    ip = fh->inode;
+    if (fat_reserve(ip, fh->position + size) != 0) {
+        // Out of space: write what still fits in the chain
+        uint32_t cap = ip->mapped_clusters * bytes_per_cluster;
+        if (cap <= fh->position) {
+            return -1;
+        }
+        if (size > cap - fh->position) {
+            size = cap - fh->position;
+        }
+    }
+    bounce_cluster = 0;     // the read bounce buffer may be about to go stale
+    
+    while (written < size) {
+        uint32_t cluster_offset = fh->position % bytes_per_cluster;
+        uint32_t sector_offset = fh->position % SECTOR_SIZE;
+        uint32_t run;
+        uint32_t n;
+        uint16_t cluster = fat_map_cluster(ip, fh->position / bytes_per_cluster, &run);
+        
+        if (cluster == 0xFFFF) {
+            break;
+        }
+        uint32_t lba = cluster_to_sector(cluster) + cluster_offset / SECTOR_SIZE;
+        fh->current_cluster = cluster;
         
-        // Move to next cluster if needed
-        if (cluster_offset + bytes_to_read >= bytes_per_cluster) {
-            uint16_t next = get_next_cluster(fh->current_cluster);
-            if (next == 0xFFFF) {
-                break; // End of file
+        if (sector_offset == 0 && size - written >= SECTOR_SIZE) {
+            // Whole sectors, up to the end of this extent
+            uint32_t max = run * bs->num_sectors_per_cluster - cluster_offset / SECTOR_SIZE;
+            n = (size - written) / SECTOR_SIZE;
+            if (n > max) {
+                n = max;
+            }
+            if (bcache_write(lba, src + written, n) != 0) {
+                rprintf("Error: Failed to write data\r\n");
+                break;
+            }
+            n *= SECTOR_SIZE;
+        } else {
+            n = SECTOR_SIZE - sector_offset;
+            if (n > size - written) {
+                n = size - written;
             }
-            fh->current_cluster = next;
+            struct buf* b = bread(lba);
+            if (!b) {
+                // Every buffer may be dirty: write them back and retry
+                bcache_sync();
+                b = bread(lba);
+            }
+            if (!b) {
+                rprintf("Error: Failed to read sector %d\r\n", lba);
+                break;
+            }
+            memcpy(b->data + sector_offset, src + written, n);
+            bdirty(b);
+            brelse(b);
         }
+        written += n;
+        fh->position += n;
     }
     
-    return bytes_read;
+    if (fh->position > ip->rde.file_size) {
+        ip->rde.file_size = fh->position;
+    }
+    if (written) {
+        ip->dirty = 1;
+    }
+    return written ? (int)written : -1;
+}
+
+// Nonzero if some handle has the file whose directory entry is at
+// (sector, index) open
+static int fat_open_anywhere(uint32_t sector, uint32_t index) {
+    uint32_t flags;
+    int busy;
+    
+    flags = spin_lock_irqsave(&files_lock);
+    busy = fat_inode_find(sector, index) != 0;
+    spin_unlock_irqrestore(&files_lock, flags);
+    return busy;
+}
+
+// Shrink a file to 'size' bytes and free the clusters past the new end.
+// Refused while another handle has the file open: its position and
+// read-ahead could be left past the new end.
+static int fat_truncate(struct file* fh, uint32_t size) {
+    struct fat_inode* ip;
+    uint32_t need;
+    uint16_t last;
+    uint32_t flags;
+    int shared;
+    
+    if (!fh || size > fh->inode->rde.file_size) {
+        return -1;
+    }
+    ip = fh->inode;
+    flags = spin_lock_irqsave(&files_lock);
+    shared = ip->refcnt > 1;
+    spin_unlock_irqrestore(&files_lock, flags);
+    if (shared) {
+        return -1;
+    }
+    if (size == ip->rde.file_size) {
+        return 0;
+    }
+    need = (size + bytes_per_cluster - 1) / bytes_per_cluster;
+    if (need == 0) {
+        fat_free_chain(ip->start_cluster);
+        ip->start_cluster = 0;
+        ip->rde.cluster = 0;
+    } else {
+        last = fat_map_cluster(ip, need - 1, 0);
+        if (last == 0xFFFF) {
+            return -1;
+        }
+        fat_free_chain(get_next_cluster(last));
+        fat_set_entry(last, fat12 ? 0xFFF : 0xFFFF);
+    }
+    
+    // Forget the map and read-ahead state; both rebuild lazily
+    ip->num_extents = 0;
+    ip->mapped_clusters = 0;
+    ip->next_unmapped = ip->start_cluster >= 2 ? ip->start_cluster : 0xFFFF;
+    fh->ra_window = 0;
+    fh->ra_pos = 0;
+    bounce_cluster = 0;
+    
+    ip->rde.file_size = size;
+    ip->dirty = 1;
+    if (fh->position > size) {
+        fh->position = size;
+    }
+    if (fh->position < size) {
+        fh->current_cluster = fat_map_cluster(ip, fh->position / bytes_per_cluster, 0);
+    }
+    return 0;
+}
+
+// Find a free entry in directory 'dir', growing a subdirectory by a
+// zeroed cluster when it is full. The fixed root directory can't grow.
+static int fat_dir_alloc_slot(uint32_t dir, uint32_t* sector, uint32_t* index) {
+    uint32_t entries_per_sector = SECTOR_SIZE / sizeof(struct root_directory_entry);
+    uint16_t cluster = 0;
+    uint16_t last = 0;
+    uint32_t lba;
+    uint32_t n;
+    uint32_t i;
+    uint32_t got;
+    
+    for (n = 0; (lba = fat_dir_sector(dir, n, &cluster)) != 0; n++) {
+        last = cluster;
+        struct buf* b = bread(lba);
+        if (!b) {
+            return -1;
+        }
+        struct root_directory_entry* entries = (struct root_directory_entry*)b->data;
+        for (i = 0; i < entries_per_sector; i++) {
+            if (entries[i].file_name[0] == 0x00 || (uint8_t)entries[i].file_name[0] == 0xE5) {
+                brelse(b);
+                *sector = lba;
+                *index = i;
+                return 0;
+            }
+        }
+        brelse(b);
+    }
+    if (dir == 0) {
+        return -1;
+    }
+    
+    cluster = fat_alloc(last, 1, &got);
+    if (!cluster) {
+        return -1;
+    }
+    memset(cluster_buffer, 0, bytes_per_cluster);
+    bounce_cluster = 0;
+    if (bcache_write(cluster_to_sector(cluster), cluster_buffer, bs->num_sectors_per_cluster) != 0) {
+        return -1;
+    }
+    *sector = cluster_to_sector(cluster);
+    *index = 0;
+    return 0;
+}
+
+// Create an empty file (or truncate an existing one) and open it
+static struct file* fat_create(const char* path) {
+    const char* last = path;
+    const char* p;
+    char parent[256];
+    char name[11];
+    uint32_t dir = 0;
+    uint32_t len;
+    uint32_t sector;
+    uint32_t index;
+    struct dentry* d;
+    struct root_directory_entry rde;
+    struct file* fh;
+    
+    // Split off the last component and resolve the directory holding it
+    for (p = path; *p; p++) {
+        if (*p == '/' || *p == '\\') {
+            last = p + 1;
+        }
+    }
+    for (p = path; p < last && (*p == '/' || *p == '\\'); p++) {
+    }
+    if (p < last) {
+        len = last - path;
+        if (len >= sizeof(parent)) {
+            return 0;
+        }
+        memcpy(parent, path, len);
+        parent[len] = '\0';
+        d = fat_lookup_path(parent);
+        if (!d || !(d->rde.attribute & FILE_ATTRIBUTE_SUBDIRECTORY)) {
+            rprintf("Error: No such directory\r\n");
+            return 0;
+        }
+        dir = d->rde.cluster;
+    }
+    for (len = 0; last[len]; len++) {
+    }
+    if (fat_make_name(last, len, name) != 0) {
+        return 0;
+    }
+    
+    d = fat_lookup(dir, name);
+    if (!d) {
+        return 0;
+    }
+    if (!d->negative) {
+        if (d->rde.attribute & FILE_ATTRIBUTE_SUBDIRECTORY) {
+            rprintf("Error: '%s' is a directory\r\n", path);
+            return 0;
+        }
+        fh = fat_open(path);
+        if (fh && fat_truncate(fh, 0) != 0) {
+            rprintf("Error: '%s' is open\r\n", path);
+            fat_close(fh);
+            return 0;
+        }
+        return fh;
+    }
+    
+    if (fat_dir_alloc_slot(dir, &sector, &index) != 0) {
+        rprintf("Error: Directory is full\r\n");
+        return 0;
+    }
+    memset(&rde, 0, sizeof(rde));
+    memcpy(rde.file_name, name, 11);
+    rde.attribute = 0x20;   // archive
+    struct buf* b = bread(sector);
+    if (!b) {
+        return 0;
+    }
+    memcpy((struct root_directory_entry*)b->data + index, &rde, sizeof(rde));
+    bdirty(b);
+    brelse(b);
+    
+    // The negative dentry from the lookup becomes the new file
+    d->negative = 0;
+    memcpy(&d->rde, &rde, sizeof(rde));
+    d->sector = sector;
+    d->index = index;
+    return fat_open(path);
+}
+
+// Remove a file. Refused for directories and files that are open.
+static int fat_unlink(const char* path) {
+    struct dentry* d = fat_lookup_path(path);
+    
+    if (!d || (d->rde.attribute & FILE_ATTRIBUTE_SUBDIRECTORY)) {
+        return -1;
+    }
+    if (fat_open_anywhere(d->sector, d->index)) {
+        return -1;
+    }
+    
+    struct buf* b = bread(d->sector);
+    if (!b) {
+        return -1;
+    }
+    ((struct root_directory_entry*)b->data)[d->index].file_name[0] = (char)0xE5;
+    bdirty(b);
+    brelse(b);
+    fat_free_chain(d->rde.cluster);
+    d->negative = 1;
+    return 0;
+}
+
+// Copy an open file's size and first cluster back into its directory entry
+static int fat_write_dirent(struct fat_inode* ip) {
+    struct dentry* d;
+    struct buf* b;
+    
+    if (!ip->dirty) {
+        return 0;
+    }
+    b = bread(ip->dirent_sector);
+    if (!b) {
+        return -1;
+    }
+    memcpy((struct root_directory_entry*)b->data + ip->dirent_index, &ip->rde,
+           sizeof(struct root_directory_entry));
+    bdirty(b);
+    brelse(b);
+    d = dcache_lookup(ip->dir_cluster, ip->rde.file_name);
+    if (d && !d->negative) {
+        memcpy(&d->rde, &ip->rde, sizeof(struct root_directory_entry));
+    }
+    ip->dirty = 0;
+    return 0;
+}
+
+// Drop a reference to an inode from fat_iget; the last one frees it.
+// Its directory entry has been written back by fatClose or fatSync.
+static void fat_iput(struct fat_inode* ip) {
+    uint32_t flags = spin_lock_irqsave(&files_lock);
+    if (--ip->refcnt > 0) {
+        spin_unlock_irqrestore(&files_lock, flags);
+        return;
+    }
+    if (ip->prev) {
+        ip->prev->next = ip->next;
+    } else {
+        open_inodes = ip->next;
+    }
+    if (ip->next) {
+        ip->next->prev = ip->prev;
+    }
+    spin_unlock_irqrestore(&files_lock, flags);
+    
+    kfree(ip->extents);
+    kmem_cache_free(inode_cache, ip);
+}
+
+// Write back directory entries of open files, the FAT and every dirty
+// block, then flush the drive's cache
+static int fat_sync(void) {
+    struct fat_inode* ip;
+    struct fat_inode* next;
+    uint32_t flags;
+    int ret = 0;
+    
+    // Hold a reference on each inode while its entry is written
+    flags = spin_lock_irqsave(&files_lock);
+    ip = open_inodes;
+    if (ip) {
+        ip->refcnt++;
+    }
+    spin_unlock_irqrestore(&files_lock, flags);
+    while (ip) {
+        if (fat_write_dirent(ip) != 0) {
+            ret = -1;
+        }
+        flags = spin_lock_irqsave(&files_lock);
+        next = ip->next;
+        if (next) {
+            next->refcnt++;
+        }
+        spin_unlock_irqrestore(&files_lock, flags);
+        fat_iput(ip);
+        ip = next;
+    }
+    if (fat_flush() != 0) {
+        ret = -1;
+    }
+    if (bcache_sync() != 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+// Take another reference to an open handle; each one needs a fatClose
+struct file* fatDup(struct file* fh) {
+    if (fh) {
+        uint32_t flags = spin_lock_irqsave(&files_lock);
+        fh->refcnt++;
+        spin_unlock_irqrestore(&files_lock, flags);
+    }
+    return fh;
+}
+
+// Drop a reference to a handle from fatOpen/fatDup; the last one frees it
+static void fat_close(struct file* fh) {
+    struct fat_inode* ip;
+    if (!fh) {
+        return;
+    }
+    uint32_t flags = spin_lock_irqsave(&files_lock);
+    if (--fh->refcnt > 0) {
+        spin_unlock_irqrestore(&files_lock, flags);
+        return;
+    }
+    num_open_files--;
+    spin_unlock_irqrestore(&files_lock, flags);
+    
+    // Deferred directory update, then push everything to disk
+    ip = fh->inode;
+    if (ip->dirty) {
+        fat_write_dirent(ip);
+        fat_flush();
+        bcache_sync();
+    }
+    fat_iput(ip);
+    kmem_cache_free(file_cache, fh);
+}
+
+// Public entry points: the static versions above with fat_lock held
+
+int fatInit(void) {
+    int ret;
+    mutex_lock(&fat_lock);
+    ret = fat_init();
+    mutex_unlock(&fat_lock);
+    return ret;
+}
+
+struct file* fatOpen(const char* filename) {
+    struct file* fh;
+    mutex_lock(&fat_lock);
+    fh = fat_open(filename);
+    mutex_unlock(&fat_lock);
+    return fh;
+}
+
+struct file* fatCreate(const char* path) {
+    struct file* fh;
+    mutex_lock(&fat_lock);
+    fh = fat_create(path);
+    mutex_unlock(&fat_lock);
+    return fh;
+}
+
+int fatRead(struct file* fh, void* buffer, uint32_t size) {
+    int ret;
+    mutex_lock(&fat_lock);
+    ret = fat_read(fh, buffer, size);
+    mutex_unlock(&fat_lock);
+    return ret;
+}
+
+int fatSeek(struct file* fh, uint32_t offset) {
+    int ret;
+    mutex_lock(&fat_lock);
+    ret = fat_seek(fh, offset);
+    mutex_unlock(&fat_lock);
+    return ret;
+}
+
+int fatWrite(struct file* fh, const void* buffer, uint32_t size) {
+    int ret;
+    mutex_lock(&fat_lock);
+    ret = fat_write(fh, buffer, size);
+    mutex_unlock(&fat_lock);
+    return ret;
+}
+
+int fatTruncate(struct file* fh, uint32_t size) {
+    int ret;
+    mutex_lock(&fat_lock);
+    ret = fat_truncate(fh, size);
+    mutex_unlock(&fat_lock);
+    return ret;
+}
+
+int fatUnlink(const char* path) {
+    int ret;
+    mutex_lock(&fat_lock);
+    ret = fat_unlink(path);
+    mutex_unlock(&fat_lock);
+    return ret;
+}
+
+int fatSync(void) {
+    int ret;
+    mutex_lock(&fat_lock);
+    ret = fat_sync();
+    mutex_unlock(&fat_lock);
+    return ret;
+}
+
+void fatClose(struct file* fh) {
+    mutex_lock(&fat_lock);
+    fat_close(fh);
+    mutex_unlock(&fat_lock);
+}
+
+// Dentry cache lookups answered from memory and from the disk
+void fatDcacheStats(uint32_t* hits, uint32_t* misses) {
+    *hits = dcache_stats.hits;
+    *misses = dcache_stats.misses;
+}
+
+// Number of handles currently open
+uint32_t fatOpenFiles(void) {
+    return num_open_files;
 }
 
 // Helper function implementations
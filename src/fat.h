@@ -3,6 +3,12 @@
 
 #include <stdint.h>
 
+// Create, write and delete a scratch file at boot (set by the Makefile).
+// Off by default: it modifies the disk image.
+#ifndef CONFIG_TEST_FAT_WRITE
+#define CONFIG_TEST_FAT_WRITE 0
+#endif
+
 #define SECTOR_SIZE 512
 #define FILE_ATTRIBUTE_SUBDIRECTORY 0x10
 
@@ -49,19 +55,62 @@ struct root_directory_entry {
     uint32_t file_size;
 }__attribute__((packed));
 
-// File handle structure
-struct file {
-    struct file *next;
-    struct file *prev;
+// A run of physically contiguous clusters in a file's chain
+struct fat_extent {
+    uint32_t file_cluster;      // index of the run's first cluster within the file
+    uint32_t start;             // its cluster number on disk
+    uint32_t length;            // clusters in the run
+};
+
+// In-memory state of one open file, shared by every handle on it: its
+// size, first cluster and chain live here, so a write through one handle
+// is seen by the others and they all extend the same chain
+struct fat_inode {
+    struct fat_inode *next;     // open-inode list
+    struct fat_inode *prev;
+    uint32_t refcnt;            // handles using it; freed when it drops to 0
     struct root_directory_entry rde;
     uint32_t start_cluster;
+    // Extent map of the cluster chain, extended lazily as far as needed
+    struct fat_extent *extents; // sorted by file_cluster
+    uint32_t num_extents;
+    uint32_t max_extents;
+    uint32_t mapped_clusters;   // clusters of the file the map covers
+    uint16_t next_unmapped;     // chain cluster after the mapped ones, 0xFFFF at the end
+    // Where rde lives on disk; size and cluster changes are copied back
+    // on fatClose/fatSync rather than on every write
+    uint32_t dir_cluster;       // containing directory, 0 for the root
+    uint32_t dirent_sector;
+    uint32_t dirent_index;
+    uint8_t dirty;              // written to since the last sync
+};
+
+// File handle structure
+struct file {
+    uint32_t refcnt;            // fatClose frees the handle when it drops to 0
+    struct fat_inode *inode;
     uint32_t position;
     uint32_t current_cluster;
+    // Read-ahead state
+    uint32_t ra_prev_end;       // where the last read stopped: reads starting here are sequential
+    uint32_t ra_pos;            // prefetch issued up to here (cluster aligned)
+    uint32_t ra_window;         // clusters to keep in flight ahead of position, 0 when off
 };
 
-// Function prototypes
+// Function prototypes. All but fatDup, fatOpenFiles and fatDcacheStats
+// take a filesystem-wide lock and may sleep: not for interrupt handlers.
 int fatInit(void);
 struct file* fatOpen(const char* filename);
 int fatRead(struct file* fh, void* buffer, uint32_t size);
+int fatSeek(struct file* fh, uint32_t offset);
+struct file* fatCreate(const char* path);
+int fatWrite(struct file* fh, const void* buffer, uint32_t size);
+int fatTruncate(struct file* fh, uint32_t size);
+int fatUnlink(const char* path);
+int fatSync(void);
+struct file* fatDup(struct file* fh);
+void fatClose(struct file* fh);
+uint32_t fatOpenFiles(void);
+void fatDcacheStats(uint32_t* hits, uint32_t* misses);
 
 #endif
@@ -0,0 +1,105 @@
+#include "fd.h"
+#include "spinlock.h"
+#include <stddef.h>
+
+static struct file *fd_table[MAX_FDS];
+static spinlock_t fd_lock = SPINLOCK_INIT;
+
+// Put fh in the lowest free slot. Returns the descriptor or -1 if full.
+static int fd_alloc(struct file *fh) {
+    int fd;
+    uint32_t flags = spin_lock_irqsave(&fd_lock);
+    for (fd = 0; fd < MAX_FDS; fd++) {
+        if (fd_table[fd] == NULL) {
+            fd_table[fd] = fh;
+            spin_unlock_irqrestore(&fd_lock, flags);
+            return fd;
+        }
+    }
+    spin_unlock_irqrestore(&fd_lock, flags);
+    return -1;
+}
+
+// Take a reference under fd_lock so a racing fd_close can't free the
+// handle while the caller uses it
+struct file *fd_get(int fd) {
+    struct file *fh;
+    uint32_t flags;
+    if (fd < 0 || fd >= MAX_FDS) {
+        return NULL;
+    }
+    flags = spin_lock_irqsave(&fd_lock);
+    fh = fatDup(fd_table[fd]);
+    spin_unlock_irqrestore(&fd_lock, flags);
+    return fh;
+}
+
+void fd_put(struct file *fh) {
+    fatClose(fh);
+}
+
+int fd_open(const char *name) {
+    struct file *fh = fatOpen(name);
+    int fd;
+    if (fh == NULL) {
+        return -1;
+    }
+    fd = fd_alloc(fh);
+    if (fd < 0) {
+        fatClose(fh);
+    }
+    return fd;
+}
+
+int fd_read(int fd, void *buffer, uint32_t size) {
+    struct file *fh = fd_get(fd);
+    int ret;
+    if (fh == NULL) {
+        return -1;
+    }
+    ret = fatRead(fh, buffer, size);
+    fd_put(fh);
+    return ret;
+}
+
+int fd_seek(int fd, uint32_t offset) {
+    struct file *fh = fd_get(fd);
+    int ret;
+    if (fh == NULL) {
+        return -1;
+    }
+    ret = fatSeek(fh, offset);
+    fd_put(fh);
+    return ret;
+}
+
+int fd_dup(int fd) {
+    struct file *fh = fd_get(fd);
+    int newfd;
+    if (fh == NULL) {
+        return -1;
+    }
+    // The reference from fd_get becomes the new descriptor's
+    newfd = fd_alloc(fh);
+    if (newfd < 0) {
+        fatClose(fh);
+    }
+    return newfd;
+}
+
+int fd_close(int fd) {
+    struct file *fh;
+    uint32_t flags;
+    if (fd < 0 || fd >= MAX_FDS) {
+        return -1;
+    }
+    flags = spin_lock_irqsave(&fd_lock);
+    fh = fd_table[fd];
+    fd_table[fd] = NULL;
+    spin_unlock_irqrestore(&fd_lock, flags);
+    if (fh == NULL) {
+        return -1;
+    }
+    fatClose(fh);
+    return 0;
+}
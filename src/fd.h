@@ -0,0 +1,24 @@
+#ifndef __FD_H__
+#define __FD_H__
+
+#include <stdint.h>
+#include "fat.h"
+
+// File descriptor table: small integers naming open FAT handles.
+// Descriptors made by fd_dup share the handle, and with it the position;
+// the handle is closed when its last descriptor is.
+
+#define MAX_FDS 32
+
+int fd_open(const char *name);
+int fd_read(int fd, void *buffer, uint32_t size);
+int fd_seek(int fd, uint32_t offset);
+int fd_dup(int fd);
+int fd_close(int fd);
+
+// Handle behind fd with a reference taken, or NULL if fd is not open.
+// Each one needs an fd_put.
+struct file *fd_get(int fd);
+void fd_put(struct file *fh);
+
+#endif
@@ -0,0 +1,292 @@
+#include "heap.h"
+#include "page.h"
+#include "spinlock.h"
+#include <stddef.h>
+
+#define HEAP_MAX_PAGES ((CONFIG_HEAP_SIZE * 1024) / PAGE_SIZE)
+#define SLAB_MIN_OBJECTS 8
+#define SLAB_MAX_ORDER 3
+
+// A slab is a naturally aligned block of 2^order frames holding this
+// header followed by equally sized objects threaded on a free list.
+struct slab {
+    struct slab *next;
+    struct slab *prev;
+    struct kmem_cache *cache;
+    void *free;
+    unsigned int inuse;
+};
+
+#define SLAB_HEADER_SIZE ((sizeof(struct slab) + 15) & ~15u)
+
+struct kmem_cache {
+    const char *name;
+    uint32_t size;
+    unsigned int order;
+    unsigned int objs_per_slab;
+    struct slab *partial;   // slabs with at least one free object
+    struct slab *full;
+    spinlock_t lock;
+};
+
+// kmalloc size classes, smallest first
+#define NUM_SIZE_CLASSES 8
+static struct kmem_cache size_caches[NUM_SIZE_CLASSES];
+static const char *size_names[NUM_SIZE_CLASSES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+
+// Backing store for caches made by kmem_cache_create()
+static struct kmem_cache cache_cache;
+
+static spinlock_t heap_lock = SPINLOCK_INIT;
+static unsigned int heap_pages = 0;
+// Bumped under different cache locks (or none), so only ever atomically
+static unsigned int heap_allocs = 0;
+static unsigned int heap_frees = 0;
+
+// Take 2^order frames for the heap, honouring CONFIG_HEAP_SIZE
+static struct ppage *heap_get_frames(unsigned int order) {
+    struct ppage *pp;
+    unsigned int n = 1u << order;
+    unsigned int i;
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    if (heap_pages + n > HEAP_MAX_PAGES) {
+        spin_unlock_irqrestore(&heap_lock, flags);
+        return NULL;
+    }
+    heap_pages += n;
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    pp = (order == 0) ? allocate_physical_pages(1) : allocate_page_block(order);
+    if (pp == NULL) {
+        flags = spin_lock_irqsave(&heap_lock);
+        heap_pages -= n;
+        spin_unlock_irqrestore(&heap_lock, flags);
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        pp[i].flags |= PPAGE_HEAP;
+        pp[i].prev = NULL;
+    }
+    return pp;
+}
+
+static void heap_put_frames(struct ppage *pp, unsigned int order) {
+    unsigned int n = 1u << order;
+    unsigned int i;
+    uint32_t flags;
+    for (i = 0; i < n; i++) {
+        pp[i].flags &= ~PPAGE_HEAP;
+        pp[i].prev = NULL;
+        pp[i].next = NULL;
+    }
+    if (order == 0) {
+        free_physical_pages(pp);
+    } else {
+        pp->order = order;
+        free_page_block(pp);
+    }
+    flags = spin_lock_irqsave(&heap_lock);
+    heap_pages -= n;
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+static void slab_list_add(struct slab **list, struct slab *s) {
+    s->prev = NULL;
+    s->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = s;
+    }
+    *list = s;
+}
+
+static void slab_list_remove(struct slab **list, struct slab *s) {
+    if (s->prev != NULL) {
+        s->prev->next = s->next;
+    } else {
+        *list = s->next;
+    }
+    if (s->next != NULL) {
+        s->next->prev = s->prev;
+    }
+    s->next = NULL;
+    s->prev = NULL;
+}
+
+static struct slab *slab_grow(struct kmem_cache *cache) {
+    struct ppage *pp;
+    struct slab *s;
+    char *obj;
+    unsigned int i;
+
+    pp = heap_get_frames(cache->order);
+    if (pp == NULL) {
+        return NULL;
+    }
+    s = (struct slab*)pp->physical_addr;
+    for (i = 0; i < (1u << cache->order); i++) {
+        pp[i].prev = (struct ppage*)s;
+    }
+
+    s->cache = cache;
+    s->inuse = 0;
+    s->free = NULL;
+    obj = (char*)s + SLAB_HEADER_SIZE;
+    for (i = 0; i < cache->objs_per_slab; i++) {
+        *(void**)obj = s->free;
+        s->free = obj;
+        obj += cache->size;
+    }
+    return s;
+}
+
+static void cache_init(struct kmem_cache *cache, const char *name, uint32_t size) {
+    // Objects hold the free-list link while free and stay 8-byte aligned
+    size = (size + 7) & ~7u;
+    if (size < sizeof(void*)) {
+        size = sizeof(void*);
+    }
+    cache->name = name;
+    cache->size = size;
+    cache->order = 0;
+    while (cache->order < SLAB_MAX_ORDER &&
+           ((PAGE_SIZE << cache->order) - SLAB_HEADER_SIZE) / size < SLAB_MIN_OBJECTS) {
+        cache->order++;
+    }
+    cache->objs_per_slab = ((PAGE_SIZE << cache->order) - SLAB_HEADER_SIZE) / size;
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->lock.locked = 0;
+}
+
+void heap_init(void) {
+    unsigned int i;
+    for (i = 0; i < NUM_SIZE_CLASSES; i++) {
+        cache_init(&size_caches[i], size_names[i], 16u << i);
+    }
+    cache_init(&cache_cache, "kmem_cache", sizeof(struct kmem_cache));
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, uint32_t size) {
+    struct kmem_cache *cache;
+    if (size == 0 || size > KMALLOC_MAX_SLAB) {
+        return NULL;
+    }
+    cache = kmem_cache_alloc(&cache_cache);
+    if (cache != NULL) {
+        cache_init(cache, name, size);
+    }
+    return cache;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+    struct slab *s;
+    void *obj;
+    uint32_t flags = spin_lock_irqsave(&cache->lock);
+
+    s = cache->partial;
+    if (s == NULL) {
+        s = slab_grow(cache);
+        if (s == NULL) {
+            spin_unlock_irqrestore(&cache->lock, flags);
+            return NULL;
+        }
+        slab_list_add(&cache->partial, s);
+    }
+    obj = s->free;
+    s->free = *(void**)obj;
+    s->inuse++;
+    if (s->free == NULL) {
+        slab_list_remove(&cache->partial, s);
+        slab_list_add(&cache->full, s);
+    }
+    __sync_fetch_and_add(&heap_allocs, 1);
+    spin_unlock_irqrestore(&cache->lock, flags);
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj) {
+    struct ppage *pp = phys_to_ppage(obj);
+    struct slab *s = (struct slab*)pp->prev;
+    uint32_t flags = spin_lock_irqsave(&cache->lock);
+
+    if (s->free == NULL) {
+        slab_list_remove(&cache->full, s);
+        slab_list_add(&cache->partial, s);
+    }
+    *(void**)obj = s->free;
+    s->free = obj;
+    s->inuse--;
+    __sync_fetch_and_add(&heap_frees, 1);
+    // Keep one empty slab around so alloc/free pairs don't thrash the PFA
+    if (s->inuse == 0 && (cache->partial != s || s->next != NULL)) {
+        slab_list_remove(&cache->partial, s);
+        heap_put_frames(phys_to_ppage(s), cache->order);
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+void *kmalloc(uint32_t size) {
+    struct ppage *pp;
+    unsigned int order = 0;
+    unsigned int i;
+
+    if (size == 0) {
+        return NULL;
+    }
+    if (size <= KMALLOC_MAX_SLAB) {
+        for (i = 0; (16u << i) < size; i++) {
+        }
+        return kmem_cache_alloc(&size_caches[i]);
+    }
+
+    // Big requests get a whole power-of-two block of frames
+    while ((PAGE_SIZE << order) < size) {
+        order++;
+    }
+    pp = heap_get_frames(order);
+    if (pp == NULL) {
+        return NULL;
+    }
+    __sync_fetch_and_add(&heap_allocs, 1);
+    return pp->physical_addr;
+}
+
+void *kzalloc(uint32_t size) {
+    char *p = kmalloc(size);
+    uint32_t i;
+    if (p != NULL) {
+        for (i = 0; i < size; i++) {
+            p[i] = 0;
+        }
+    }
+    return p;
+}
+
+void kfree(void *ptr) {
+    struct ppage *pp;
+    struct slab *s;
+    if (ptr == NULL) {
+        return;
+    }
+    pp = phys_to_ppage(ptr);
+    if (pp == NULL || !(pp->flags & PPAGE_HEAP)) {
+        return;     // not ours
+    }
+    s = (struct slab*)pp->prev;
+    if (s != NULL) {
+        kmem_cache_free(s->cache, ptr);
+        return;
+    }
+    __sync_fetch_and_add(&heap_frees, 1);
+    heap_put_frames(pp, pp->order);
+}
+
+void get_heap_stats(struct heap_stats *stats) {
+    stats->pages = heap_pages;
+    stats->max_pages = HEAP_MAX_PAGES;
+    stats->allocs = heap_allocs;
+    stats->frees = heap_frees;
+}
@@ -0,0 +1,34 @@
+#ifndef __HEAP_H__
+#define __HEAP_H__
+
+#include <stdint.h>
+
+// Upper bound on kernel heap memory, in KiB (set by the Makefile)
+#ifndef CONFIG_HEAP_SIZE
+#define CONFIG_HEAP_SIZE 4096
+#endif
+
+// Largest request served from a size-class slab; bigger ones get whole pages
+#define KMALLOC_MAX_SLAB 2048
+
+struct kmem_cache;
+
+struct heap_stats {
+    unsigned int pages;         // frames currently owned by the heap
+    unsigned int max_pages;     // CONFIG_HEAP_SIZE in frames
+    unsigned int allocs;
+    unsigned int frees;
+};
+
+void heap_init(void);
+void *kmalloc(uint32_t size);
+void *kzalloc(uint32_t size);
+void kfree(void *ptr);
+void get_heap_stats(struct heap_stats *stats);
+
+// Dedicated caches for hot fixed-size objects
+struct kmem_cache *kmem_cache_create(const char *name, uint32_t size);
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+#endif
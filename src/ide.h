@@ -1,11 +1,64 @@
 #ifndef __IDE_H__
 #define __IDE_H__
 
-// ATA LBA read function (implemented in assembly)
-// @param lba - Logical Block Address of sector
-// @param buffer - Pointer to buffer to store data
-// @param numsectors - Number of sectors to read
+// Interrupt-driven driver for the primary master (ata.c). Normal I/O
+// goes through the block request queue (blk.c), which serialises
+// commands on the channel; ata_lba_read/ata_lba_write are the polled
+// way in for early boot and panic paths that can't use it.
+
+// Completion callback, run from the IRQ handler: status is 0 or -1
+typedef void (*ata_done_fn)(int status, void *arg);
+
+// One piece of a scatter/gather transfer: count sectors at buffer.
+// Consecutive segments cover consecutive LBAs.
+struct ata_seg {
+    unsigned char *buffer;
+    unsigned int count;
+};
+
+#define ATA_MAX_SEGS 32
+
+// Probe the drive and hook up IRQ14/IRQ15
+// @return 0 if a drive answered on the primary channel
+int ata_init(void);
+
+// Sectors per DRQ block in use with READ MULTIPLE, 0 for one per IRQ
+unsigned int ata_multiple(void);
+
+// Nonzero when transfers use PCI bus-master DMA instead of PIO
+int ata_dma_enabled(void);
+
+// Drive capacity in sectors (LBA48 drives report up to 2^32 - 1)
+unsigned int ata_sectors(void);
+
+// Start a transfer and return immediately; done() runs when it ends.
+// The sectors from lba onwards are spread over nsegs buffers. The
+// segment list is copied, so it may live on the caller's stack.
+// @return 0 if the command was issued, -1 if the channel is busy or absent
+int ata_transfer_async(unsigned int lba, const struct ata_seg *segs, unsigned int nsegs,
+                       int write, ata_done_fn done, void *arg);
+
+// Start flushing the drive's write cache (FLUSH CACHE / FLUSH CACHE
+// EXT); done() runs when the data is on the medium. Only the blk queue
+// calls this, once everything written before the flush has completed.
+// @return 0 if the command was issued, -1 if the channel is busy or absent
+int ata_flush_async(ata_done_fn done, void *arg);
+
+// Called by the IRQ14/IRQ15 stubs in interrupt.c
+void ata_irq(int channel);
+
+// Make progress on the primary channel's command without interrupts
+void ata_poll(void);
+
+// Polled transfers: issue the command and poll it to completion, with
+// interrupts on or off. They use the same commands as blk (up to 256
+// sectors each, READ/WRITE MULTIPLE or DMA, LBA48 past the 28-bit
+// limit), but bypass the block cache.
+// @param lba - Logical Block Address of the first sector
+// @param buffer - numsectors * 512 bytes to read into or write from
+// @param numsectors - Number of sectors to transfer
 // @return 0 on success, -1 on failure
 int ata_lba_read(unsigned int lba, unsigned char *buffer, unsigned int numsectors);
+int ata_lba_write(unsigned int lba, const unsigned char *buffer, unsigned int numsectors);
 
 #endif
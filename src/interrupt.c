@@ -1,6 +1,16 @@
 #include <stdint.h>
 #include "interrupt.h"
 #include "keyboard.h"
+#include "rprintf.h"
+#include "vmem.h"
+#include "ide.h"
+#include "timer.h"
+#include "sched.h"
+#include "apic.h"
+#include "serial.h"
+#include "smp.h"
+
+extern int putc(int data);
 
 struct idt_entry idt_entries[256];
 struct idt_ptr   idt_ptr;
@@ -16,6 +26,26 @@ uint8_t inb(uint16_t _port) {
     return rv;
 }
 
+void outw(uint16_t _port, uint16_t val) {
+    __asm__ __volatile__ ("outw %0, %1" : : "a" (val), "dN" (_port));
+}
+
+uint16_t inw(uint16_t _port) {
+    uint16_t rv;
+    __asm__ __volatile__ ("inw %1, %0" : "=a" (rv) : "dN" (_port));
+    return rv;
+}
+
+void outl(uint16_t _port, uint32_t val) {
+    __asm__ __volatile__ ("outl %0, %1" : : "a" (val), "dN" (_port));
+}
+
+uint32_t inl(uint16_t _port) {
+    uint32_t rv;
+    __asm__ __volatile__ ("inl %1, %0" : "=a" (rv) : "dN" (_port));
+    return rv;
+}
+
 void memset(char *s, char c, unsigned int n) {
     for(int k = 0; k < n; k++) {
         s[k] = c;
@@ -96,12 +126,22 @@ void write_tss(struct gdt_entry_bits *g) {
     tss_flush(0x2b);
 }
 
+// Once apic_init() has moved the ISA IRQs to the I/O APIC, the local
+// APIC takes the EOI and the masks live in the redirection table
 void PIC_sendEOI(unsigned char irq) {
+    if (ioapic_enabled()) {
+        lapic_eoi();
+        return;
+    }
     if(irq >= 8) outb(PIC_2_COMMAND, PIC_EOI);
     outb(PIC_1_COMMAND, PIC_EOI);
 }
 
 void IRQ_set_mask(unsigned char IRQline) {
+    if (ioapic_enabled()) {
+        ioapic_set_mask(IRQline, 1);
+        return;
+    }
     uint16_t port = (IRQline < 8) ? PIC_1_DATA : PIC_2_DATA;
     if(IRQline >= 8) IRQline -= 8;
     uint8_t value = inb(port) | (1 << IRQline);
@@ -109,6 +149,10 @@ void IRQ_set_mask(unsigned char IRQline) {
 }
 
 void IRQ_clear_mask(unsigned char IRQline) {
+    if (ioapic_enabled()) {
+        ioapic_set_mask(IRQline, 0);
+        return;
+    }
     uint16_t port = (IRQline < 8) ? PIC_1_DATA : PIC_2_DATA;
     if(IRQline >= 8) IRQline -= 8;
     uint8_t value = inb(port) & ~(1 << IRQline);
@@ -124,10 +168,81 @@ __attribute__((interrupt)) void stub_isr(struct interrupt_frame* frame) {
     while(1);
 }
 
+__attribute__((interrupt)) void page_fault_handler(struct interrupt_frame* frame, unsigned long error_code) {
+    uint32_t addr;
+    asm volatile("mov %%cr2, %0" : "=r"(addr));
+    if (vm_handle_fault(addr, error_code) == 0) {
+        return;
+    }
+    esp_printf(putc, "\r\nPage fault at 0x%x (eip 0x%x, error 0x%x)\r\n",
+               addr, frame->eip, (uint32_t)error_code);
+    asm("cli");
+    while(1);
+}
+
+__attribute__((interrupt)) void timer_handler(struct interrupt_frame* frame) {
+    timer_irq();
+    PIC_sendEOI(0);
+    sched_preempt();
+}
+
 __attribute__((interrupt)) void keyboard_handler(struct interrupt_frame* frame) {
-    uint8_t scancode = inb(0x60);
-    handle_keyboard_input(scancode);
-    outb(0x20, 0x20);
+    keyboard_irq(inb(0x60));
+    PIC_sendEOI(1);
+    sched_preempt();
+}
+
+__attribute__((interrupt)) void serial_handler(struct interrupt_frame* frame) {
+    serial_irq();
+    PIC_sendEOI(COM1_IRQ);
+    sched_preempt();
+}
+
+__attribute__((interrupt)) void ata_primary_handler(struct interrupt_frame* frame) {
+    ata_irq(0);
+    PIC_sendEOI(14);
+    sched_preempt();
+}
+
+__attribute__((interrupt)) void ata_secondary_handler(struct interrupt_frame* frame) {
+    // On the 8259s 0x2F is also where a spurious IRQ15 lands. The slave
+    // never put it in service, but the master did see a real IRQ2.
+    if (!ioapic_enabled()) {
+        outb(PIC_2_COMMAND, PIC_READ_ISR);
+        if (!(inb(PIC_2_COMMAND) & 0x80)) {
+            outb(PIC_1_COMMAND, PIC_EOI);
+            return;
+        }
+    }
+    ata_irq(1);
+    PIC_sendEOI(15);
+    sched_preempt();
+}
+
+// Another CPU queued work for this one
+__attribute__((interrupt)) void resched_handler(struct interrupt_frame* frame) {
+    lapic_eoi();
+    sched_preempt();
+}
+
+// Another CPU unmapped pages and waits for us to drop them from the TLB
+__attribute__((interrupt)) void tlb_handler(struct interrupt_frame* frame) {
+    smp_tlb_ack();
+    lapic_eoi();
+}
+
+// The local APIC does not expect an EOI for these
+__attribute__((interrupt)) void spurious_handler(struct interrupt_frame* frame) {
+}
+
+// A masked 8259 still raises IRQ7 (or IRQ15 on the slave) when a line
+// drops before the CPU acks it; there is nothing to EOI on the master
+__attribute__((interrupt)) void pic_spurious_handler(struct interrupt_frame* frame) {
+}
+
+// The master saw a real IRQ2 from the slave, so only it wants an EOI
+__attribute__((interrupt)) void pic_spurious_slave_handler(struct interrupt_frame* frame) {
+    outb(PIC_1_COMMAND, PIC_EOI);
 }
 
 static void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags) {
@@ -147,7 +262,18 @@ void init_idt() {
     for(int i = 0; i < 256; i++){
         idt_set_gate(i, (uint32_t)stub_isr, 0x08, 0x8E);
     }
+    idt_set_gate(14, (uint32_t)page_fault_handler, 0x08, 0x8e);
+    idt_set_gate(0x20, (uint32_t)timer_handler, 0x08, 0x8e);
     idt_set_gate(0x21, (uint32_t)keyboard_handler, 0x08, 0x8e);
+    idt_set_gate(0x24, (uint32_t)serial_handler, 0x08, 0x8e);
+    idt_set_gate(0x2E, (uint32_t)ata_primary_handler, 0x08, 0x8e);
+    idt_set_gate(0x2F, (uint32_t)ata_secondary_handler, 0x08, 0x8e);
+    idt_set_gate(0x27, (uint32_t)pic_spurious_handler, 0x08, 0x8e);
+    idt_set_gate(PIC_PARKED_BASE + 7, (uint32_t)pic_spurious_handler, 0x08, 0x8e);
+    idt_set_gate(PIC_PARKED_BASE + 15, (uint32_t)pic_spurious_slave_handler, 0x08, 0x8e);
+    idt_set_gate(RESCHED_VECTOR, (uint32_t)resched_handler, 0x08, 0x8e);
+    idt_set_gate(TLB_VECTOR, (uint32_t)tlb_handler, 0x08, 0x8e);
+    idt_set_gate(SPURIOUS_VECTOR, (uint32_t)spurious_handler, 0x08, 0x8e);
     idt_flush(&idt_ptr);
 }
 
@@ -156,11 +282,26 @@ void remap_pic(void) {
     outb(PIC_2_CTRL, 0x11);
     outb(PIC_1_DATA, 0x20);
     outb(PIC_2_DATA, 0x28);
-    outb(PIC_1_DATA, 0x00);
-    outb(PIC_2_DATA, 0x00);
+    outb(PIC_1_DATA, 0x04);     // slave on IRQ2
+    outb(PIC_2_DATA, 0x02);     // cascade identity
     outb(PIC_1_DATA, 0x01);
     outb(PIC_2_DATA, 0x01);
     outb(0x21, 0xff);
     outb(0xA1, 0xff);
     outb(0x21, 0xfd);
 }
+
+// Move the 8259s off the vectors the I/O APIC now uses and mask every
+// line, so their spurious IRQ7/IRQ15 can't be mistaken for a device
+void park_pic(void) {
+    outb(PIC_1_CTRL, 0x11);
+    outb(PIC_2_CTRL, 0x11);
+    outb(PIC_1_DATA, PIC_PARKED_BASE);
+    outb(PIC_2_DATA, PIC_PARKED_BASE + 8);
+    outb(PIC_1_DATA, 0x04);
+    outb(PIC_2_DATA, 0x02);
+    outb(PIC_1_DATA, 0x01);
+    outb(PIC_2_DATA, 0x01);
+    outb(PIC_1_DATA, 0xFF);
+    outb(PIC_2_DATA, 0xFF);
+}
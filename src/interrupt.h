@@ -10,10 +10,13 @@
 #define PIC_2_COMMAND   PIC2
 #define PIC_1_DATA      0x21
 #define PIC_2_DATA      0xA1
+#define PIC_READ_ISR    0x0B    // OCW3: next command port read returns the ISR
 
 #define IDT_SIZE 256
 #define PIC_1_CTRL 0x20
 #define PIC_2_CTRL 0xA0
+// Where the 8259s' vectors go once the I/O APIC owns 0x20-0x2F
+#define PIC_PARKED_BASE 0x30
 
 struct idt_entry {
    uint16_t base_lo;
@@ -119,7 +122,12 @@ void init_idt();
 void tss_flush(uint16_t tss);
 void load_gdt();
 void remap_pic(void);
+void park_pic(void);
 void outb(uint16_t _port, uint8_t val);
 uint8_t inb(uint16_t _port);
+void outw(uint16_t _port, uint16_t val);
+uint16_t inw(uint16_t _port);
+void outl(uint16_t _port, uint32_t val);
+uint32_t inl(uint16_t _port);
 
 #endif
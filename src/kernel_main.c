@@ -3,6 +3,18 @@
 #include "interrupt.h"
 #include "keyboard.h"
 #include "fat.h"
+#include "page.h"
+#include "heap.h"
+#include "paging.h"
+#include "ide.h"
+#include "pci.h"
+#include "timer.h"
+#include "sched.h"
+#include "apic.h"
+#include "smp.h"
+#include "cpu.h"
+#include "serial.h"
+#include "multiboot.h"
 
 #define VGA_W      80
 #define VGA_H      25
@@ -46,12 +58,84 @@ int putc(int data) {
     }
 
     scroll_if_needed();
+    serial_putc(ch);
     return 0;
 }
 
-static void delay(int ms) { for (volatile int i = 0; i < ms * 100000; i++) {} }
-
 // FAT filesystem test command
+// Round trip through the FAT write path on a scratch file: create it,
+// write across a cluster boundary, read it back, truncate, unlink, sync.
+// Returns 0 if every step checked out.
+static int test_fat_write(void) {
+    static uint8_t out[10000];     // crosses a cluster boundary for clusters up to 8 KiB
+    static uint8_t in[sizeof(out)];
+    const char* name = "/WRTEST.TMP";
+    struct file* fh;
+    uint32_t i;
+    int n;
+    
+    for (i = 0; i < sizeof(out); i++) {
+        out[i] = (uint8_t)(i * 7 + (i >> 8));
+    }
+    
+    esp_printf(putc, "\r\nWrite test on '%s'...\r\n", name);
+    fh = fatCreate(name);
+    if (!fh) {
+        esp_printf(putc, "[ERROR] Create failed\r\n");
+        return -1;
+    }
+    // An odd split exercises both partial-sector and whole-sector writes
+    if (fatWrite(fh, out, 1000) != 1000 ||
+        fatWrite(fh, out + 1000, sizeof(out) - 1000) != (int)(sizeof(out) - 1000)) {
+        esp_printf(putc, "[ERROR] Write failed\r\n");
+        fatClose(fh);
+        return -1;
+    }
+    fatClose(fh);
+    
+    fh = fatOpen(name);
+    if (!fh) {
+        esp_printf(putc, "[ERROR] Reopen failed\r\n");
+        return -1;
+    }
+    n = fatRead(fh, in, sizeof(in));
+    for (i = 0; n == (int)sizeof(in) && i < sizeof(in) && in[i] == out[i]; i++) {
+    }
+    if (i != sizeof(in)) {
+        esp_printf(putc, "[ERROR] Read back %d bytes, mismatch at %d\r\n", n, i);
+        fatClose(fh);
+        return -1;
+    }
+    esp_printf(putc, "[OK] %d bytes read back intact\r\n", n);
+    
+    if (fatTruncate(fh, 1500) != 0 || fatSeek(fh, 0) != 0 ||
+        fatRead(fh, in, sizeof(in)) != 1500) {
+        esp_printf(putc, "[ERROR] Truncate failed\r\n");
+        fatClose(fh);
+        return -1;
+    }
+    for (i = 0; i < 1500 && in[i] == out[i]; i++) {
+    }
+    fatClose(fh);
+    if (i != 1500) {
+        esp_printf(putc, "[ERROR] Truncated data mismatch at %d\r\n", i);
+        return -1;
+    }
+    esp_printf(putc, "[OK] Truncated to 1500 bytes\r\n");
+    
+    if (fatUnlink(name) != 0 || (fh = fatOpen(name)) != 0) {
+        esp_printf(putc, "[ERROR] Unlink failed\r\n");
+        fatClose(fh);
+        return -1;
+    }
+    if (fatSync() != 0) {
+        esp_printf(putc, "[ERROR] Sync failed\r\n");
+        return -1;
+    }
+    esp_printf(putc, "[OK] Unlinked and synced\r\n");
+    return 0;
+}
+
 void test_fat_filesystem(void) {
     esp_printf(putc, "\r\n=== FAT Filesystem Test ===\r\n");
     
@@ -76,6 +160,7 @@ void test_fat_filesystem(void) {
     int bytes_read = fatRead(fh, buffer, sizeof(buffer) - 1);
     if (bytes_read < 0) {
         esp_printf(putc, "[ERROR] Failed to read file!\r\n");
+        fatClose(fh);
         return;
     }
     
@@ -84,11 +169,23 @@ void test_fat_filesystem(void) {
     esp_printf(putc, "\r\n--- File Contents (%d bytes) ---\r\n", bytes_read);
     esp_printf(putc, "%s\r\n", buffer);
     esp_printf(putc, "--- End of File ---\r\n");
+    fatClose(fh);
+    
+    esp_printf(putc, "\r\nOpening '/boot/grub/grub.cfg'...\r\n");
+    fh = fatOpen("/boot/grub/grub.cfg");
+    if (fh) {
+        esp_printf(putc, "[OK] Resolved through subdirectories\r\n");
+        fatClose(fh);
+    }
+    
+    if (CONFIG_TEST_FAT_WRITE && test_fat_write() != 0) {
+        return;
+    }
     
     esp_printf(putc, "\r\n[OK] FAT filesystem test completed!\r\n");
 }
 
-void kernel_main(void) {
+void kernel_main(uint32_t magic, struct multiboot_info *mbi) {
     for (int r = 0; r < VGA_H; ++r)
         for (int c = 0; c < VGA_W; ++c)
             VGA[r * VGA_W + c] = ((uint16_t)VGA_COLOR << 8) | ' ';
@@ -96,7 +193,6 @@ void kernel_main(void) {
     esp_printf(putc, "===========================================\r\n");
     esp_printf(putc, "  Custom OS - COMP 310 Operating Systems\r\n");
     esp_printf(putc, "===========================================\r\n\r\n");
-    delay(200);
 
     esp_printf(putc, "Initializing interrupt system...\r\n");
     remap_pic();
@@ -104,9 +200,63 @@ void kernel_main(void) {
     init_idt();
     esp_printf(putc, "[OK] IDT & PIC ready\r\n");
 
+    timer_init();
+    if (timer_tickless()) {
+        esp_printf(putc, "[OK] Timer: TSC at %d MHz, tick-less PIT\r\n", tsc_khz() / 1000);
+    } else {
+        esp_printf(putc, "[OK] Timer: no TSC, PIT ticking at %d Hz\r\n", TIMER_HZ);
+    }
+
+    esp_printf(putc, "Initializing page frame allocator...\r\n");
+    if (magic != MULTIBOOT_BOOTLOADER_MAGIC) {
+        esp_printf(putc, "[ERROR] Bad Multiboot magic 0x%x, no memory map\r\n", magic);
+        mbi = NULL;
+    }
+    init_pfa_list(mbi);
+    if (CONFIG_TEST_PAGE) {
+        test_page_allocator();
+    }
+    struct pfa_stats stats;
+    get_pfa_stats(&stats);
+    esp_printf(putc, "[OK] %d MiB free, %d large frames\r\n",
+               stats.free_pages / (1024 * 1024 / PAGE_SIZE), stats.free_large_pages);
+    heap_init();
+    esp_printf(putc, "[OK] Kernel heap ready (%d KiB max)\r\n", CONFIG_HEAP_SIZE);
+
+    esp_printf(putc, "Enabling paging...\r\n");
+    init_paging();
+    esp_printf(putc, "[OK] Paging enabled\r\n");
+
+    sched_init();
+    esp_printf(putc, "[OK] Scheduler ready, %d ms slices\r\n", SCHED_SLICE_MS);
+
+    if (apic_init() == 0) {
+        esp_printf(putc, "[OK] APIC: %d CPUs in the MADT\r\n", num_cpus);
+    } else {
+        esp_printf(putc, "[OK] No APIC, staying on the 8259 PICs\r\n");
+    }
+    if (serial_init() == 0) {
+        esp_printf(putc, "[OK] COM1 at %d baud on IRQ%d\r\n", SERIAL_BAUD, COM1_IRQ);
+    }
+
     esp_printf(putc, "Enabling interrupts...\r\n");
     asm("sti");
-    esp_printf(putc, "[OK] IRQs enabled\r\n\r\n");
+    esp_printf(putc, "[OK] IRQs enabled\r\n");
+
+    esp_printf(putc, "[OK] SMP: %d CPUs online\r\n", smp_init());
+
+    esp_printf(putc, "[OK] PCI: %d functions found\r\n", pci_scan());
+    if (ata_init() == 0) {
+        esp_printf(putc, "[OK] ATA disk: %d MiB\r\n", ata_sectors() >> 11);
+        if (ata_dma_enabled()) {
+            esp_printf(putc, "[OK] ATA disk on IRQ14, bus-master DMA\r\n\r\n");
+        } else {
+            esp_printf(putc, "[OK] ATA disk on IRQ14, %d sectors per interrupt\r\n\r\n",
+                       ata_multiple() ? ata_multiple() : 1);
+        }
+    } else {
+        esp_printf(putc, "[ERROR] No ATA disk on the primary channel\r\n\r\n");
+    }
 
     test_fat_filesystem();
     esp_printf(putc, "\r\n");
@@ -114,5 +264,6 @@ void kernel_main(void) {
     esp_printf(putc, "Type 'help' for commands.\r\n\r\n");
     init_keyboard();
 
-    while (1) asm("hlt");
+    // The boot context is now the idle thread
+    sched_idle();
 }
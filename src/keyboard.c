@@ -2,6 +2,14 @@
 #include "keyboard.h"
 #include "rprintf.h"
 #include "fat.h"
+#include "fd.h"
+#include "bcache.h"
+#include "blk.h"
+#include "timer.h"
+#include "sched.h"
+#include "spinlock.h"
+#include "ring.h"
+#include "serial.h"
 
 extern int putc(int data);
 
@@ -46,35 +54,54 @@ static char cmd_buffer[CMD_BUFFER_SIZE];
 static int  cmd_index = 0;
 static int  shift_pressed = 0;
 
-static void process_command(void) {
-    cmd_buffer[cmd_index] = '\0';
+// The ISR only queues scancodes; decoding, echo and commands all run on
+// the shell thread, so keys typed during a long command wait their turn
+// instead of being dropped. The serial port feeds the same thread.
+#define SCANCODE_RING_SIZE 128
+RING_DEFINE(scancodes, SCANCODE_RING_SIZE);
+static struct wait_queue shell_wq = WAIT_QUEUE_INIT;
+static int serial_cr;       // last serial byte was CR, so skip an LF
 
-    if (cmd_index == 0) {
+static const char *thread_states[] = { "running", "ready", "blocked", "dead" };
+
+static void print_thread(struct thread *t) {
+    esp_printf(putc, "  %d %s prio %d cpu %d %s\r\n", t->id, t->name, t->priority,
+               t->cpu, thread_states[t->state]);
+}
+
+static void process_command(const char *cmd) {
+    if (cmd[0] == '\0') {
         my_puts("$ ");
         return;
     }
 
-    if (my_strcmp(cmd_buffer, "help") == 0) {
+    if (my_strcmp(cmd, "help") == 0) {
         my_puts("\r\nAvailable commands:\r\n");
         my_puts("  help  - Show this help message\r\n");
         my_puts("  clear - Clear the screen (poor-man)\r\n");
         my_puts("  echo  - Echo test message\r\n");
         my_puts("  about - About this OS\r\n");
-        my_puts("  time  - Show uptime message\r\n");
+        my_puts("  time  - Show uptime\r\n");
         my_puts("  fat   - Test FAT filesystem\r\n");
-    } else if (my_strcmp(cmd_buffer, "clear") == 0) {
+        my_puts("  cache - Show block cache statistics\r\n");
+        my_puts("  threads - List kernel threads\r\n");
+    } else if (my_strcmp(cmd, "clear") == 0) {
         for (int i = 0; i < 25; i++) my_puts("\r\n");
         my_puts("Screen cleared!\r\n");
-    } else if (my_strcmp(cmd_buffer, "echo") == 0) {
+    } else if (my_strcmp(cmd, "echo") == 0) {
         my_puts("\r\nHello from your OS!\r\n");
-    } else if (my_strcmp(cmd_buffer, "about") == 0) {
+    } else if (my_strcmp(cmd, "about") == 0) {
         my_puts("\r\nCustom OS - COMP 310 Project\r\n");
         my_puts("Interrupt-driven keyboard handler\r\n");
         my_puts("Built with love and assembly!\r\n");
-    } else if (my_strcmp(cmd_buffer, "time") == 0) {
-        my_puts("\r\nSystem has been running since boot.\r\n");
-        my_puts("Uptime: Unknown (no timer yet)\r\n");
-    } else if (my_strcmp(cmd_buffer, "fat") == 0) {
+    } else if (my_strcmp(cmd, "time") == 0) {
+        uint32_t ms = clock_ms();
+        struct timer_stats tst;
+        get_timer_stats(&tst);
+        esp_printf(putc, "\r\nUptime: %d.%d%d%d s\r\n", ms / 1000,
+                   ms / 100 % 10, ms / 10 % 10, ms % 10);
+        esp_printf(putc, "Timer: %d interrupts, %d timers fired\r\n", tst.irqs, tst.expired);
+    } else if (my_strcmp(cmd, "fat") == 0) {
         my_puts("\r\n=== FAT Filesystem Test ===\r\n");
         
         my_puts("Initializing FAT filesystem...\r\n");
@@ -84,12 +111,12 @@ static void process_command(void) {
             my_puts("[OK] FAT initialized\r\n");
             
             my_puts("Opening 'testfile.txt'...\r\n");
-            struct file* fh = fatOpen("testfile.txt");
-            if (!fh) {
+            int fd = fd_open("testfile.txt");
+            if (fd < 0) {
                 my_puts("[ERROR] File not found!\r\n");
             } else {
                 static char buffer[256];
-                int bytes = fatRead(fh, buffer, sizeof(buffer) - 1);
+                int bytes = fd_read(fd, buffer, sizeof(buffer) - 1);
                 if (bytes > 0) {
                     buffer[bytes] = '\0';
                     my_puts("File contents:\r\n");
@@ -100,30 +127,37 @@ static void process_command(void) {
                 } else {
                     my_puts("[ERROR] Read failed!\r\n");
                 }
+                fd_close(fd);
             }
         }
+    } else if (my_strcmp(cmd, "cache") == 0) {
+        struct bcache_stats st;
+        struct blk_stats bst;
+        get_bcache_stats(&st);
+        get_blk_stats(&bst);
+        esp_printf(putc, "\r\nBlock cache: %d hits, %d misses, %d evictions, %d dirty, %d read ahead\r\n",
+                   st.hits, st.misses, st.evictions, st.dirty, st.readahead);
+        esp_printf(putc, "Block queue: %d requests, %d merged, %d disk commands\r\n",
+                   bst.requests, bst.merged, bst.commands);
+        uint32_t dhits, dmisses;
+        fatDcacheStats(&dhits, &dmisses);
+        esp_printf(putc, "Dentry cache: %d hits, %d misses\r\n", dhits, dmisses);
+    } else if (my_strcmp(cmd, "threads") == 0) {
+        struct sched_stats sst;
+        get_sched_stats(&sst);
+        esp_printf(putc, "\r\n%d threads, %d switches, %d preemptions\r\n",
+                   sst.threads, sst.switches, sst.preemptions);
+        sched_for_each(print_thread);
     } else {
         my_puts("\r\nUnknown command: ");
-        my_puts(cmd_buffer);
+        my_puts(cmd);
         my_puts("\r\nType 'help' for available commands.\r\n");
     }
 
-    cmd_index = 0;
     my_puts("$ ");
 }
 
-void handle_keyboard_input(uint8_t scancode) {
-    // Left/Right Shift press
-    if (scancode == 0x2A || scancode == 0x36) { shift_pressed = 1; return; }
-    // Left/Right Shift release (0x2A|0x36 + 0x80)
-    if (scancode == 0xAA || scancode == 0xB6) { shift_pressed = 0; return; }
-
-    // Only handle key-down
-    if (scancode >= 0x80) return;
-
-    char ch = shift_pressed ? keyboard_map_shift[scancode]
-                            : keyboard_map[scancode];
-
+static void handle_char(char ch) {
     if (ch == '\b') {
         if (cmd_index > 0) {
             cmd_index--;
@@ -133,7 +167,9 @@ void handle_keyboard_input(uint8_t scancode) {
     } else if (ch == '\n') {
         // CRLF then process
         putc('\r'); putc('\n');
-        process_command();
+        cmd_buffer[cmd_index] = '\0';
+        cmd_index = 0;
+        process_command(cmd_buffer);
     } else if (ch != 0) {
         if (cmd_index < CMD_BUFFER_SIZE - 1) {
             cmd_buffer[cmd_index++] = ch;
@@ -142,8 +178,77 @@ void handle_keyboard_input(uint8_t scancode) {
     }
 }
 
+static void handle_scancode(uint8_t scancode) {
+    // Left/Right Shift press
+    if (scancode == 0x2A || scancode == 0x36) { shift_pressed = 1; return; }
+    // Left/Right Shift release (0x2A|0x36 + 0x80)
+    if (scancode == 0xAA || scancode == 0xB6) { shift_pressed = 0; return; }
+
+    // Only handle key-down
+    if (scancode >= 0x80) return;
+
+    handle_char(shift_pressed ? keyboard_map_shift[scancode]
+                              : keyboard_map[scancode]);
+}
+
+// Terminals send CR for Enter (some CR LF) and DEL for backspace
+static void handle_serial(uint8_t c) {
+    int cr = serial_cr;
+    serial_cr = c == '\r';
+    if (c == '\r' || (c == '\n' && !cr)) {
+        handle_char('\n');
+    } else if (c == 0x7F || c == '\b') {
+        handle_char('\b');
+    } else if (c >= ' ' && c < 0x7F) {
+        handle_char(c);
+    }
+}
+
+static int input_pending(void) {
+    return !ring_empty(&scancodes) || serial_rx_pending();
+}
+
+static uint32_t input_dropped(void) {
+    return scancodes.dropped + serial_rx_dropped();
+}
+
+static void shell_thread(void *arg) {
+    uint32_t flags;
+    uint32_t dropped = 0;
+    uint8_t scancode;
+    int c;
+    (void)arg;
+    my_puts("$ ");
+    for (;;) {
+        flags = spin_lock_irqsave(&shell_wq.lock);
+        while (!input_pending()) {
+            sleep_on(&shell_wq);
+        }
+        spin_unlock_irqrestore(&shell_wq.lock, flags);
+        if (input_dropped() != dropped) {
+            esp_printf(putc, "\r\n[WARN] %d keys lost, input too far ahead\r\n",
+                       input_dropped() - dropped);
+            dropped = input_dropped();
+        }
+        while (ring_pop(&scancodes, &scancode) == 0) {
+            handle_scancode(scancode);
+        }
+        while ((c = serial_getc()) >= 0) {
+            handle_serial(c);
+        }
+    }
+}
+
+void keyboard_irq(uint8_t scancode) {
+    ring_push(&scancodes, scancode);
+    wake_up(&shell_wq);
+}
+
 void init_keyboard(void) {
     cmd_index = 0;
     shift_pressed = 0;
-    my_puts("$ ");
+    serial_rx_notify(&shell_wq);
+    if (thread_create("shell", SCHED_PRIO_NORMAL, shell_thread, NULL) == NULL) {
+        my_puts("[ERROR] No shell thread\r\n");
+    }
 }
@@ -3,7 +3,8 @@
 
 #include <stdint.h>
 
-void handle_keyboard_input(uint8_t scancode);
+// Called from the IRQ1 handler: queue the scancode for the shell thread
+void keyboard_irq(uint8_t scancode);
 void init_keyboard(void);
 
 #endif
@@ -0,0 +1,43 @@
+#ifndef __MULTIBOOT_H__
+#define __MULTIBOOT_H__
+
+#include <stdint.h>
+
+// Value GRUB leaves in eax when it jumps to _start
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2BADB002
+
+// multiboot_info flags
+#define MULTIBOOT_INFO_MEMORY   0x001   // mem_lower/mem_upper are valid
+#define MULTIBOOT_INFO_MEM_MAP  0x040   // mmap_addr/mmap_length are valid
+
+// Memory map entry types
+#define MULTIBOOT_MEMORY_AVAILABLE 1
+
+// Multiboot v1 information structure (pointer arrives in ebx)
+struct multiboot_info {
+    uint32_t flags;
+    uint32_t mem_lower;         // KiB below 1 MiB
+    uint32_t mem_upper;         // KiB above 1 MiB
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length;
+    uint32_t mmap_addr;
+    uint32_t drives_length;
+    uint32_t drives_addr;
+    uint32_t config_table;
+    uint32_t boot_loader_name;
+    uint32_t apm_table;
+}__attribute__((packed));
+
+// One entry of the BIOS memory map. 'size' does not count itself.
+struct multiboot_mmap_entry {
+    uint32_t size;
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;
+}__attribute__((packed));
+
+#endif
@@ -20,7 +20,9 @@ _start:
     # Set up stack
     mov $stack_top, %esp
     
-    # Call kernel_main
+    # Pass the Multiboot magic (eax) and info pointer (ebx) to kernel_main
+    push %ebx
+    push %eax
     call kernel_main
     
     # Hang if kernel_main returns
@@ -1,86 +1,491 @@
 #include "page.h"
+#include "multiboot.h"
+#include "spinlock.h"
+#include "cpu.h"
+#include "paging.h"
 #include <stddef.h>
 
-#define PAGE_SIZE 0x200000
-#define PHYSICAL_MEMORY_START 0x00000000
-
-struct ppage physical_page_array[128];
-static struct ppage *free_pp_list = NULL;
-
-void init_pfa_list(void) {
-    int i;
-    physical_page_array[0].next = NULL;
-    physical_page_array[0].prev = NULL;
-    physical_page_array[0].physical_addr = (void*)(PHYSICAL_MEMORY_START);
-    free_pp_list = &physical_page_array[0];
-    for (i = 1; i < 128; i++) {
-        physical_page_array[i].physical_addr = (void*)(PHYSICAL_MEMORY_START + (i * PAGE_SIZE));
-        physical_page_array[i].prev = &physical_page_array[i - 1];
+#define LOW_MEMORY_END 0x100000     // BIOS data, VGA and ROM live below 1 MiB
+#define MAX_PHYS_ADDR ((uint64_t)IDENTITY_MAP_LIMIT)   // frames must be reachable
+
+extern char end_kernel[];
+
+// Frame database, one entry per frame up to the highest usable address.
+// It is carved out of RAM right after the kernel image.
+struct ppage *physical_page_array = NULL;
+static unsigned int num_pages = 0;
+
+// Buddy free lists: free_area[k] holds the head frame of every free 2^k block
+static struct ppage *free_area[PAGE_MAX_ORDER];
+static unsigned int nr_free[PAGE_MAX_ORDER];
+static unsigned int free_pages = 0;
+static unsigned int large_splits = 0;
+static unsigned int large_merges = 0;
+static spinlock_t zone_lock = SPINLOCK_INIT;
+
+// Per-CPU magazines of free single frames. Single-frame alloc/free only
+// touches the local magazine with interrupts off; the buddy lists (and
+// zone_lock) are hit once per PCP_BATCH frames to refill or drain it.
+#define PCP_HIGH  32    // magazine capacity
+#define PCP_BATCH 16    // frames moved per refill/drain
+
+struct pcp_cache {
+    unsigned int count;
+    struct ppage *frames[PCP_HIGH];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct pcp_cache pcp[MAX_CPUS];
+
+static unsigned int page_index(struct ppage *p) {
+    return p - physical_page_array;
+}
+
+static void free_area_push(struct ppage *p, unsigned int order) {
+    p->order = order;
+    p->flags |= PPAGE_FREE;
+    p->prev = NULL;
+    p->next = free_area[order];
+    if (free_area[order] != NULL) {
+        free_area[order]->prev = p;
+    }
+    free_area[order] = p;
+    nr_free[order]++;
+}
+
+static void free_area_remove(struct ppage *p) {
+    if (p->prev != NULL) {
+        p->prev->next = p->next;
+    } else {
+        free_area[p->order] = p->next;
+    }
+    if (p->next != NULL) {
+        p->next->prev = p->prev;
+    }
+    nr_free[p->order]--;
+    p->flags &= ~PPAGE_FREE;
+    p->next = NULL;
+    p->prev = NULL;
+}
+
+// Return a 2^order block, merging with its buddy for as long as the buddy is free
+static void free_block(struct ppage *p, unsigned int order) {
+    unsigned int idx = page_index(p);
+    free_pages += 1u << order;
+    while (order < PAGE_MAX_ORDER - 1) {
+        unsigned int buddy_idx = idx ^ (1u << order);
+        if (buddy_idx >= num_pages) {
+            break;
+        }
+        struct ppage *buddy = &physical_page_array[buddy_idx];
+        if (!(buddy->flags & PPAGE_FREE) || buddy->order != order) {
+            break;
+        }
+        free_area_remove(buddy);
+        idx &= ~(1u << order);
+        order++;
+        if (order == LARGE_PAGE_ORDER) {
+            large_merges++;
+        }
+    }
+    free_area_push(&physical_page_array[idx], order);
+}
+
+// Take a 2^order block, splitting the smallest larger block if needed
+static struct ppage *alloc_block(unsigned int order) {
+    unsigned int o = order;
+    struct ppage *p;
+    while (o < PAGE_MAX_ORDER && free_area[o] == NULL) {
+        o++;
+    }
+    if (o >= PAGE_MAX_ORDER) {
+        return NULL;
+    }
+    p = free_area[o];
+    free_area_remove(p);
+    if (o == LARGE_PAGE_ORDER && order < LARGE_PAGE_ORDER) {
+        large_splits++;
+    }
+    // Hand the upper halves back until the block is the size we want
+    while (o > order) {
+        o--;
+        free_area_push(p + (1u << o), o);
+    }
+    p->order = order;
+    free_pages -= 1u << order;
+    return p;
+}
+
+static unsigned int order_for(unsigned int npages) {
+    unsigned int order = 0;
+    while ((1u << order) < npages) {
+        order++;
+    }
+    return order;
+}
+
+// Largest order whose block still fits in npages
+static unsigned int floor_order(unsigned int npages) {
+    unsigned int order = 0;
+    while ((2u << order) <= npages) {
+        order++;
+    }
+    return order;
+}
+
+// Link frames [p, p+n) into a list and append it to *tail
+static void chain_frames(struct ppage *p, unsigned int n, struct ppage **head, struct ppage **tail) {
+    unsigned int i;
+    for (i = 0; i < n; i++) {
+        p[i].order = 0;
+        p[i].next = NULL;
+        p[i].prev = *tail;
+        if (*tail != NULL) {
+            (*tail)->next = &p[i];
+        } else {
+            *head = &p[i];
+        }
+        *tail = &p[i];
+    }
+}
+
+// Return up to n magazine frames to the buddy lists. zone_lock held.
+static void pcp_drain(struct pcp_cache *c, unsigned int n) {
+    while (n > 0 && c->count > 0) {
+        free_block(c->frames[--c->count], 0);
+        n--;
+    }
+}
+
+static struct ppage *pcp_alloc(void) {
+    uint32_t flags = irq_save();
+    struct pcp_cache *c = &pcp[cpu_id()];
+    struct ppage *p = NULL;
+    if (c->count == 0) {
+        spin_lock(&zone_lock);
+        while (c->count < PCP_BATCH && (p = alloc_block(0)) != NULL) {
+            c->frames[c->count++] = p;
+        }
+        spin_unlock(&zone_lock);
+    }
+    p = NULL;
+    if (c->count > 0) {
+        p = c->frames[--c->count];
+        p->next = NULL;
+        p->prev = NULL;
+    }
+    irq_restore(flags);
+    return p;
+}
+
+static void pcp_free(struct ppage *p) {
+    uint32_t flags = irq_save();
+    struct pcp_cache *c = &pcp[cpu_id()];
+    if (c->count == PCP_HIGH) {
+        spin_lock(&zone_lock);
+        pcp_drain(c, PCP_BATCH);
+        spin_unlock(&zone_lock);
+    }
+    p->order = 0;
+    c->frames[c->count++] = p;
+    irq_restore(flags);
+}
+
+// Call f(start_pfn, end_pfn) for every available RAM range below MAX_PHYS_ADDR
+static void for_each_ram_range(const struct multiboot_info *mbi,
+                               void (*f)(unsigned int, unsigned int)) {
+    if (mbi == NULL) {
+        return;
+    }
+    if (mbi->flags & MULTIBOOT_INFO_MEM_MAP) {
+        uint32_t addr = mbi->mmap_addr;
+        while (addr < mbi->mmap_addr + mbi->mmap_length) {
+            struct multiboot_mmap_entry *e = (struct multiboot_mmap_entry*)addr;
+            uint64_t start = e->addr;
+            uint64_t end = e->addr + e->len;
+            addr += e->size + sizeof(e->size);
+            if (e->type != MULTIBOOT_MEMORY_AVAILABLE || start >= MAX_PHYS_ADDR) {
+                continue;
+            }
+            if (end > MAX_PHYS_ADDR) {
+                end = MAX_PHYS_ADDR;
+            }
+            // Only whole frames are usable
+            f((start + PAGE_SIZE - 1) >> PAGE_SHIFT, end >> PAGE_SHIFT);
+        }
+    } else if (mbi->flags & MULTIBOOT_INFO_MEMORY) {
+        uint64_t end = LOW_MEMORY_END + (uint64_t)mbi->mem_upper * 1024;
+        f(LOW_MEMORY_END >> PAGE_SHIFT, end >> PAGE_SHIFT);
+    }
+}
+
+// RAM ranges from the memory map, copied out on the first pass so that
+// building the frame database cannot clobber the map before we are done
+#define MAX_RAM_RANGES 32
+
+struct pfn_range {
+    unsigned int start;
+    unsigned int end;
+};
+
+static struct pfn_range ram_ranges[MAX_RAM_RANGES];
+static unsigned int num_ram_ranges;
+
+static void record_range(unsigned int start_pfn, unsigned int end_pfn) {
+    if (start_pfn >= end_pfn || num_ram_ranges == MAX_RAM_RANGES) {
+        return;
+    }
+    ram_ranges[num_ram_ranges].start = start_pfn;
+    ram_ranges[num_ram_ranges].end = end_pfn;
+    num_ram_ranges++;
+    if (end_pfn > num_pages) {
+        num_pages = end_pfn;
+    }
+}
+
+// Frames the bootloader's info block and memory map sit in. They may be
+// anywhere, so they stay allocated even when above the frame database.
+#define MAX_BOOT_RESERVED 2
+
+static struct pfn_range boot_reserved[MAX_BOOT_RESERVED];
+static unsigned int num_boot_reserved;
+
+static void reserve_boot_range(uint32_t start, uint32_t len) {
+    boot_reserved[num_boot_reserved].start = start >> PAGE_SHIFT;
+    boot_reserved[num_boot_reserved].end = (start + len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    num_boot_reserved++;
+}
+
+static int boot_reserved_pfn(unsigned int pfn) {
+    unsigned int i;
+    for (i = 0; i < num_boot_reserved; i++) {
+        if (pfn >= boot_reserved[i].start && pfn < boot_reserved[i].end) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// First address at or after start where size bytes of frame database
+// miss every boot-reserved range
+static uint32_t place_frame_db(uint32_t start, uint32_t size) {
+    unsigned int i;
+    int moved = 1;
+    while (moved) {
+        moved = 0;
+        for (i = 0; i < num_boot_reserved; i++) {
+            uint32_t lo = boot_reserved[i].start << PAGE_SHIFT;
+            uint32_t hi = boot_reserved[i].end << PAGE_SHIFT;
+            if (start < hi && start + size > lo) {
+                start = hi;
+                moved = 1;
+            }
+        }
+    }
+    return start;
+}
+
+static unsigned int first_free_pfn;
+
+static void free_range(unsigned int start_pfn, unsigned int end_pfn) {
+    unsigned int i;
+    if (start_pfn < first_free_pfn) {
+        start_pfn = first_free_pfn;
+    }
+    for (i = start_pfn; i < end_pfn; i++) {
+        if (!boot_reserved_pfn(i)) {
+            free_block(&physical_page_array[i], 0);
+        }
+    }
+}
+
+// Build the frame database from the Multiboot memory map. Everything
+// below the end of the frame database itself (low memory, the kernel
+// image and the database) stays reserved, as do the Multiboot info and
+// map wherever GRUB put them. The database goes after the kernel but
+// steps over the info and map when they are in the way.
+void init_pfa_list(const struct multiboot_info *mbi) {
+    unsigned int i;
+    uint32_t reserved_end;
+
+    for (i = 0; i < PAGE_MAX_ORDER; i++) {
+        free_area[i] = NULL;
+        nr_free[i] = 0;
+    }
+    for (i = 0; i < MAX_CPUS; i++) {
+        pcp[i].count = 0;
+    }
+    free_pages = 0;
+    num_pages = 0;
+    num_ram_ranges = 0;
+    num_boot_reserved = 0;
+    for_each_ram_range(mbi, record_range);
+
+    if (mbi != NULL) {
+        reserve_boot_range((uint32_t)mbi, sizeof(*mbi));
+        if (mbi->flags & MULTIBOOT_INFO_MEM_MAP) {
+            reserve_boot_range(mbi->mmap_addr, mbi->mmap_length);
+        }
+    }
+
+    physical_page_array = (struct ppage*)place_frame_db(((uint32_t)end_kernel + 15) & ~15u,
+                                                        num_pages * sizeof(struct ppage));
+    reserved_end = (uint32_t)(physical_page_array + num_pages);
+    for (i = 0; i < num_pages; i++) {
+        physical_page_array[i].physical_addr = (void*)(i << PAGE_SHIFT);
         physical_page_array[i].next = NULL;
-        physical_page_array[i - 1].next = &physical_page_array[i];
+        physical_page_array[i].prev = NULL;
+        physical_page_array[i].order = 0;
+        physical_page_array[i].flags = 0;
+    }
+
+    first_free_pfn = (reserved_end + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    for (i = 0; i < num_ram_ranges; i++) {
+        free_range(ram_ranges[i].start, ram_ranges[i].end);
+    }
+    // Boot-time coalescing is not reassembly
+    large_merges = 0;
+}
+
+// Take 2^order frames from the buddy lists, falling back to draining this
+// CPU's magazine when the frames we need are parked there. zone_lock held.
+static struct ppage *alloc_block_drain(unsigned int order) {
+    struct ppage *block = alloc_block(order);
+    if (block == NULL) {
+        pcp_drain(&pcp[cpu_id()], PCP_HIGH);
+        block = alloc_block(order);
     }
+    return block;
 }
 
+// Allocates npages frames as a linked list. Single frames come from the
+// per-CPU magazine. Larger requests are physically contiguous whenever a
+// large enough buddy block exists; otherwise they are assembled from the
+// biggest blocks still available.
 struct ppage *allocate_physical_pages(unsigned int npages) {
-    struct ppage *allocated_list = NULL;
-    struct ppage *current = NULL;
-    struct ppage *temp = NULL;
+    struct ppage *head = NULL;
+    struct ppage *tail = NULL;
+    struct ppage *block;
+    unsigned int order;
     unsigned int i;
-    if (free_pp_list == NULL || npages == 0) {
+    uint32_t flags;
+
+    if (npages == 0) {
         return NULL;
     }
-    unsigned int available = 0;
-    temp = free_pp_list;
-    while (temp != NULL) {
-        available++;
-        temp = temp->next;
+    if (npages == 1) {
+        return pcp_alloc();
     }
-    if (available < npages) {
+
+    flags = spin_lock_irqsave(&zone_lock);
+    if (npages > free_pages) {
+        pcp_drain(&pcp[cpu_id()], PCP_HIGH);
+    }
+    if (npages > free_pages) {
+        spin_unlock_irqrestore(&zone_lock, flags);
         return NULL;
     }
-    for (i = 0; i < npages; i++) {
-        if (free_pp_list == NULL) {
-            return allocated_list;
+
+    order = order_for(npages);
+    if (order < PAGE_MAX_ORDER && (block = alloc_block_drain(order)) != NULL) {
+        // Give back the unused tail of the power-of-two block as aligned chunks
+        for (i = npages; i < (1u << order); i += i & -i) {
+            free_block(block + i, floor_order(i & -i));
         }
-        current = free_pp_list;
-        free_pp_list = free_pp_list->next;
-        if (free_pp_list != NULL) {
-            free_pp_list->prev = NULL;
+        chain_frames(block, npages, &head, &tail);
+        spin_unlock_irqrestore(&zone_lock, flags);
+        return head;
+    }
+
+    while (npages > 0) {
+        order = floor_order(npages);
+        if (order >= PAGE_MAX_ORDER) {
+            order = PAGE_MAX_ORDER - 1;
         }
-        if (allocated_list == NULL) {
-            allocated_list = current;
-            current->next = NULL;
-            current->prev = NULL;
-        } else {
-            temp = allocated_list;
-            while (temp->next != NULL) {
-                temp = temp->next;
-            }
-            temp->next = current;
-            current->prev = temp;
-            current->next = NULL;
+        while ((block = alloc_block(order)) == NULL) {
+            order--;
         }
+        chain_frames(block, 1u << order, &head, &tail);
+        npages -= 1u << order;
     }
-    return allocated_list;
+    spin_unlock_irqrestore(&zone_lock, flags);
+    return head;
 }
 
 void free_physical_pages(struct ppage *ppage_list) {
-    struct ppage *tail = NULL;
-    if (ppage_list == NULL) {
-        return;
+    struct ppage *next;
+    while (ppage_list != NULL) {
+        next = ppage_list->next;
+        pcp_free(ppage_list);
+        ppage_list = next;
+    }
+}
+
+struct ppage *get_free_list(unsigned int order) {
+    if (order >= PAGE_MAX_ORDER) {
+        return NULL;
+    }
+    return free_area[order];
+}
+
+// Free frames, counting the ones parked in per-CPU magazines
+unsigned int get_free_page_count(void) {
+    unsigned int count = free_pages;
+    unsigned int i;
+    for (i = 0; i < MAX_CPUS; i++) {
+        count += pcp[i].count;
     }
-    tail = ppage_list;
-    while (tail->next != NULL) {
-        tail = tail->next;
+    return count;
+}
+
+void get_pfa_stats(struct pfa_stats *stats) {
+    stats->free_pages = get_free_page_count();
+    stats->free_large_pages = nr_free[LARGE_PAGE_ORDER];
+    stats->large_splits = large_splits;
+    stats->large_merges = large_merges;
+}
+
+struct ppage *allocate_page_block(unsigned int order) {
+    struct ppage *block;
+    uint32_t flags;
+    if (order >= PAGE_MAX_ORDER) {
+        return NULL;
     }
-    if (free_pp_list != NULL) {
-        tail->next = free_pp_list;
-        free_pp_list->prev = tail;
+    flags = spin_lock_irqsave(&zone_lock);
+    block = alloc_block_drain(order);
+    spin_unlock_irqrestore(&zone_lock, flags);
+    return block;
+}
+
+void free_page_block(struct ppage *block) {
+    uint32_t flags;
+    if (block == NULL) {
+        return;
     }
-    ppage_list->prev = NULL;
-    free_pp_list = ppage_list;
+    flags = spin_lock_irqsave(&zone_lock);
+    free_block(block, block->order);
+    spin_unlock_irqrestore(&zone_lock, flags);
 }
 
-struct ppage *get_free_list(void) {
-    return free_pp_list;
+// End of the frame database, i.e. the highest usable RAM address
+uint32_t get_phys_mem_end(void) {
+    return num_pages << PAGE_SHIFT;
+}
+
+struct ppage *phys_to_ppage(void *addr) {
+    uint32_t pfn = (uint32_t)addr >> PAGE_SHIFT;
+    if (pfn >= num_pages) {
+        return NULL;
+    }
+    return &physical_page_array[pfn];
+}
+
+struct ppage *allocate_large_page(void) {
+    return allocate_page_block(LARGE_PAGE_ORDER);
+}
+
+void free_large_page(struct ppage *large) {
+    if (large != NULL) {
+        large->order = LARGE_PAGE_ORDER;
+        free_page_block(large);
+    }
 }
@@ -1,15 +1,61 @@
 #ifndef __PAGE_H__
 #define __PAGE_H__
 
+#include <stdint.h>
+
+// Run the allocator self-test at boot (set by the Makefile)
+#ifndef CONFIG_TEST_PAGE
+#define CONFIG_TEST_PAGE 0
+#endif
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1u << PAGE_SHIFT)
+
+// Buddy orders: a block of order k is 2^k contiguous 4 KiB frames.
+// Order LARGE_PAGE_ORDER is a 4 MiB large frame, the size of a PSE page.
+#define LARGE_PAGE_ORDER 10
+#define LARGE_PAGE_SIZE (PAGE_SIZE << LARGE_PAGE_ORDER)
+#define PAGE_MAX_ORDER (LARGE_PAGE_ORDER + 1)
+
+// ppage flags
+#define PPAGE_FREE  0x01    // head of a free block sitting in free_area[order]
+#define PPAGE_HEAP  0x02    // owned by the kernel heap; prev points at the slab
+                            // header, or is NULL for a page-sized kmalloc
+
 struct ppage {
     struct ppage *next;
     struct ppage *prev;
     void *physical_addr;
+    uint8_t order;
+    uint8_t flags;
 };
 
-void init_pfa_list(void);
+struct multiboot_info;
+
+// Allocator counters, see get_pfa_stats()
+struct pfa_stats {
+    unsigned int free_pages;        // free 4 KiB frames, large frames included
+    unsigned int free_large_pages;  // free, intact 4 MiB large frames
+    unsigned int large_splits;      // large frames broken up for small allocations
+    unsigned int large_merges;      // large frames reassembled on free
+};
+
+void init_pfa_list(const struct multiboot_info *mbi);
 struct ppage *allocate_physical_pages(unsigned int npages);
 void free_physical_pages(struct ppage *ppage_list);
-struct ppage *get_free_list(void);
+struct ppage *get_free_list(unsigned int order);
+unsigned int get_free_page_count(void);
+void get_pfa_stats(struct pfa_stats *stats);
+
+// Single power-of-two blocks, returned as their head frame
+struct ppage *allocate_page_block(unsigned int order);
+void free_page_block(struct ppage *block);
+struct ppage *phys_to_ppage(void *addr);
+uint32_t get_phys_mem_end(void);
+struct ppage *allocate_large_page(void);
+void free_large_page(struct ppage *large);
+
+// Boot-time self-test, see test_page.c
+void test_page_allocator(void);
 
 #endif
@@ -0,0 +1,184 @@
+#include "paging.h"
+#include "page.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "rprintf.h"
+#include "vmem.h"
+
+extern int putc(int data);
+
+#define CR0_WP  0x00010000
+#define CR0_PG  0x80000000
+#define CR4_PSE 0x00000010
+#define CR4_PGE 0x00000080
+
+#define PD_INDEX(v) ((v) >> 22)
+#define PT_INDEX(v) (((v) >> 12) & 0x3FF)
+
+static uint32_t kernel_pd[1024] __attribute__((aligned(4096)));
+static spinlock_t paging_lock = SPINLOCK_INIT;
+static int have_pse = 0;
+
+static inline void write_cr3(uint32_t pd) {
+    asm volatile("mov %0, %%cr3" : : "r"(pd) : "memory");
+}
+
+static inline uint32_t read_cr0(void) {
+    uint32_t v;
+    asm volatile("mov %%cr0, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr0(uint32_t v) {
+    asm volatile("mov %0, %%cr0" : : "r"(v) : "memory");
+}
+
+static inline uint32_t read_cr4(void) {
+    uint32_t v;
+    asm volatile("mov %%cr4, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr4(uint32_t v) {
+    asm volatile("mov %0, %%cr4" : : "r"(v) : "memory");
+}
+
+// Return the page table covering vaddr, allocating a zeroed one if asked.
+// paging_lock held.
+static uint32_t *get_page_table(uint32_t vaddr, int create) {
+    uint32_t pde = kernel_pd[PD_INDEX(vaddr)];
+    struct ppage *pp;
+    uint32_t *pt;
+    int i;
+
+    if (pde & PTE_PRESENT) {
+        if (pde & PDE_LARGE) {
+            return 0;
+        }
+        return (uint32_t*)(pde & PAGE_FRAME_MASK);
+    }
+    if (!create) {
+        return 0;
+    }
+    pp = allocate_physical_pages(1);
+    if (pp == 0) {
+        return 0;
+    }
+    pt = (uint32_t*)pp->physical_addr;
+    for (i = 0; i < 1024; i++) {
+        pt[i] = 0;
+    }
+    kernel_pd[PD_INDEX(vaddr)] = (uint32_t)pt | PTE_PRESENT | PTE_WRITABLE;
+    return pt;
+}
+
+// Map one 4 KiB page. Fails if vaddr is covered by a 4 MiB page or no
+// frame is left for a new page table.
+int map_page(uint32_t vaddr, uint32_t paddr, uint32_t flags) {
+    uint32_t *pt;
+    uint32_t irq = spin_lock_irqsave(&paging_lock);
+    pt = get_page_table(vaddr, 1);
+    if (pt == 0) {
+        spin_unlock_irqrestore(&paging_lock, irq);
+        return -1;
+    }
+    pt[PT_INDEX(vaddr)] = (paddr & PAGE_FRAME_MASK) | (flags & 0xFFF) | PTE_PRESENT;
+    invlpg(vaddr);
+    spin_unlock_irqrestore(&paging_lock, irq);
+    return 0;
+}
+
+// Remove a 4 KiB mapping, returning the frame it pointed at (0 if none)
+uint32_t unmap_page(uint32_t vaddr) {
+    uint32_t *pt;
+    uint32_t old = 0;
+    uint32_t irq = spin_lock_irqsave(&paging_lock);
+    pt = get_page_table(vaddr, 0);
+    if (pt != 0 && (pt[PT_INDEX(vaddr)] & PTE_PRESENT)) {
+        old = pt[PT_INDEX(vaddr)] & PAGE_FRAME_MASK;
+        pt[PT_INDEX(vaddr)] = 0;
+        invlpg(vaddr);
+    }
+    spin_unlock_irqrestore(&paging_lock, irq);
+    return old;
+}
+
+// Translate a mapped virtual address, 0 if unmapped
+uint32_t virt_to_phys(uint32_t vaddr) {
+    uint32_t pde = kernel_pd[PD_INDEX(vaddr)];
+    uint32_t pte;
+    if (!(pde & PTE_PRESENT)) {
+        return 0;
+    }
+    if (pde & PDE_LARGE) {
+        return (pde & LARGE_PAGE_MASK) | (vaddr & ~LARGE_PAGE_MASK);
+    }
+    pte = ((uint32_t*)(pde & PAGE_FRAME_MASK))[PT_INDEX(vaddr)];
+    if (!(pte & PTE_PRESENT)) {
+        return 0;
+    }
+    return (pte & PAGE_FRAME_MASK) | (vaddr & ~PAGE_FRAME_MASK);
+}
+
+// Identity map the pages covering [paddr, paddr + size) that are not
+// mapped yet: device registers above the RAM map, or firmware tables just
+// past the end of usable RAM. The kernel's virtual areas are off limits.
+int map_identity(uint32_t paddr, uint32_t size, uint32_t flags) {
+    uint32_t addr = paddr & PAGE_FRAME_MASK;
+    uint32_t end = paddr + size;
+    if (size == 0 || end < paddr || (end > VMEM_START && paddr < VMEM_END)) {
+        return -1;
+    }
+    for (; addr < end && addr >= (paddr & PAGE_FRAME_MASK); addr += PAGE_SIZE) {
+        if (virt_to_phys(addr) == addr) {
+            continue;
+        }
+        if (map_page(addr, addr, flags | PTE_GLOBAL) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Identity map all RAM and turn paging on. With PSE every 4 MiB of RAM,
+// kernel image included, costs one PDE and one TLB entry; without it we
+// fall back to 4 KiB page tables.
+void init_paging(void) {
+    uint32_t ram_end = get_phys_mem_end();
+    uint32_t global = 0;
+    uint32_t addr;
+    int i;
+
+    for (i = 0; i < 1024; i++) {
+        kernel_pd[i] = 0;
+    }
+    have_pse = cpu_has_feature(CPUID_FEAT_EDX_PSE);
+    if (cpu_has_feature(CPUID_FEAT_EDX_PGE)) {
+        write_cr4(read_cr4() | CR4_PGE);
+        global = PTE_GLOBAL;
+    }
+
+    // Always cover the first 4 MiB: BIOS data, VGA text memory and the kernel
+    if (ram_end < LARGE_PAGE_SIZE) {
+        ram_end = LARGE_PAGE_SIZE;
+    }
+    if (have_pse) {
+        write_cr4(read_cr4() | CR4_PSE);
+        for (addr = 0; addr < ram_end && addr < IDENTITY_MAP_LIMIT; addr += LARGE_PAGE_SIZE) {
+            kernel_pd[PD_INDEX(addr)] = addr | PDE_LARGE | PTE_PRESENT | PTE_WRITABLE | global;
+        }
+    } else {
+        for (addr = 0; addr < ram_end && addr < IDENTITY_MAP_LIMIT; addr += PAGE_SIZE) {
+            if (map_page(addr, addr, PTE_WRITABLE | global) != 0) {
+                esp_printf(putc, "Error: out of frames for page tables at 0x%x\r\n", addr);
+                break;
+            }
+        }
+    }
+
+    write_cr3((uint32_t)kernel_pd);
+    write_cr0(read_cr0() | CR0_PG | CR0_WP);
+
+    esp_printf(putc, "  Identity mapped %d MiB with %s pages\r\n",
+               ram_end >> 20, have_pse ? "4 MiB" : "4 KiB");
+}
@@ -0,0 +1,41 @@
+#ifndef __PAGING_H__
+#define __PAGING_H__
+
+#include <stdint.h>
+
+// Page directory / page table entry bits
+#define PTE_PRESENT   0x001
+#define PTE_WRITABLE  0x002
+#define PTE_USER      0x004
+#define PTE_PWT       0x008
+#define PTE_PCD       0x010     // cache disable, for MMIO
+#define PTE_ACCESSED  0x020
+#define PTE_DIRTY     0x040
+#define PDE_LARGE     0x080     // 4 MiB PSE page
+#define PTE_GLOBAL    0x100
+
+#define PAGE_FRAME_MASK 0xFFFFF000
+#define LARGE_PAGE_MASK 0xFFC00000
+
+// RAM is identity mapped below this address; kernel virtual areas
+// (demand-paged regions, MMIO) live above it.
+#define IDENTITY_MAP_LIMIT 0xC0000000
+
+void init_paging(void);
+int map_page(uint32_t vaddr, uint32_t paddr, uint32_t flags);
+uint32_t unmap_page(uint32_t vaddr);
+uint32_t virt_to_phys(uint32_t vaddr);
+int map_identity(uint32_t paddr, uint32_t size, uint32_t flags);
+
+static inline void invlpg(uint32_t vaddr) {
+    asm volatile("invlpg (%0)" : : "r"(vaddr) : "memory");
+}
+
+// Drop every non-global TLB entry on this CPU
+static inline void flush_tlb(void) {
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0\n"
+                 "mov %0, %%cr3" : "=r"(cr3) : : "memory");
+}
+
+#endif
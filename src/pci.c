@@ -0,0 +1,94 @@
+#include "pci.h"
+#include "interrupt.h"
+#include "heap.h"
+#include <stddef.h>
+
+static struct pci_device *pci_devices = NULL;
+
+static uint32_t pci_address(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset) {
+    return 0x80000000 | ((uint32_t)bus << 16) | ((uint32_t)dev << 11) |
+           ((uint32_t)func << 8) | (offset & 0xFC);
+}
+
+uint32_t pci_config_read(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(bus, dev, func, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+void pci_config_write(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset, uint32_t value) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(bus, dev, func, offset));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+static void pci_add(uint8_t bus, uint8_t dev, uint8_t func, uint32_t id) {
+    struct pci_device *pdev = kzalloc(sizeof(struct pci_device));
+    uint32_t class_reg;
+    int i;
+    if (pdev == NULL) {
+        return;
+    }
+    class_reg = pci_config_read(bus, dev, func, PCI_CLASS);
+    pdev->bus = bus;
+    pdev->dev = dev;
+    pdev->func = func;
+    pdev->vendor_id = id & 0xFFFF;
+    pdev->device_id = id >> 16;
+    pdev->class_code = class_reg >> 24;
+    pdev->subclass = (class_reg >> 16) & 0xFF;
+    pdev->prog_if = (class_reg >> 8) & 0xFF;
+    for (i = 0; i < 6; i++) {
+        pdev->bar[i] = pci_config_read(bus, dev, func, PCI_BAR0 + i * 4);
+    }
+    pdev->next = pci_devices;
+    pci_devices = pdev;
+}
+
+// Brute-force walk of every bus/device/function through mechanism #1.
+// Returns the number of functions found.
+int pci_scan(void) {
+    unsigned int bus;
+    unsigned int dev;
+    unsigned int func;
+    unsigned int nfuncs;
+    uint32_t id;
+    int found = 0;
+
+    for (bus = 0; bus < 256; bus++) {
+        for (dev = 0; dev < 32; dev++) {
+            id = pci_config_read(bus, dev, 0, PCI_VENDOR_ID);
+            if ((id & 0xFFFF) == 0xFFFF) {
+                continue;
+            }
+            // Bit 7 of the header type marks a multi-function device
+            nfuncs = (pci_config_read(bus, dev, 0, PCI_HEADER_TYPE) & 0x00800000) ? 8 : 1;
+            for (func = 0; func < nfuncs; func++) {
+                if (func > 0) {
+                    id = pci_config_read(bus, dev, func, PCI_VENDOR_ID);
+                    if ((id & 0xFFFF) == 0xFFFF) {
+                        continue;
+                    }
+                }
+                pci_add(bus, dev, func, id);
+                found++;
+            }
+        }
+    }
+    return found;
+}
+
+struct pci_device *pci_find_class(uint8_t class_code, uint8_t subclass) {
+    struct pci_device *pdev;
+    for (pdev = pci_devices; pdev != NULL; pdev = pdev->next) {
+        if (pdev->class_code == class_code && pdev->subclass == subclass) {
+            return pdev;
+        }
+    }
+    return NULL;
+}
+
+void pci_enable_bus_master(struct pci_device *pdev) {
+    uint32_t cmd = pci_config_read(pdev->bus, pdev->dev, pdev->func, PCI_COMMAND);
+    // Keep the upper (status) half zero: its bits are write-1-to-clear
+    cmd = (cmd & 0xFFFF) | PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER;
+    pci_config_write(pdev->bus, pdev->dev, pdev->func, PCI_COMMAND, cmd);
+}
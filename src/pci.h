@@ -0,0 +1,42 @@
+#ifndef __PCI_H__
+#define __PCI_H__
+
+#include <stdint.h>
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+// Configuration space offsets
+#define PCI_VENDOR_ID   0x00
+#define PCI_COMMAND     0x04
+#define PCI_CLASS       0x08    // revision, prog IF, subclass, class
+#define PCI_HEADER_TYPE 0x0C    // byte 2 of this dword
+#define PCI_BAR0        0x10
+
+#define PCI_COMMAND_IO         0x0001
+#define PCI_COMMAND_MEMORY     0x0002
+#define PCI_COMMAND_BUS_MASTER 0x0004
+
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE  0x01
+
+struct pci_device {
+    struct pci_device *next;
+    uint8_t bus;
+    uint8_t dev;
+    uint8_t func;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint32_t bar[6];
+};
+
+uint32_t pci_config_read(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset);
+void pci_config_write(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset, uint32_t value);
+int pci_scan(void);
+struct pci_device *pci_find_class(uint8_t class_code, uint8_t subclass);
+void pci_enable_bus_master(struct pci_device *pdev);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdint.h>
+#include "cpu.h"
+
+// Byte queue between exactly one producer and one consumer, e.g. an
+// interrupt handler and the thread that drains it. Each index has a
+// single writer, so neither side takes a lock, and they sit on separate
+// cache lines so the two CPUs do not bounce one line between them.
+// head and tail run freely and wrap; the size must be a power of two.
+struct ring {
+    uint8_t *buf;
+    uint32_t mask;                      // size - 1
+    // Written by the producer
+    volatile uint32_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+    volatile uint32_t dropped;          // pushes refused while full
+    // Written by the consumer
+    volatile uint32_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+// storage must be an array, so its size is known here
+#define RING_INIT(storage) { (storage), sizeof(storage) - 1, 0, 0, 0 }
+
+// A file-scope ring with its own storage
+#define RING_DEFINE(name, size)                                              \
+    _Static_assert(((size) & ((size) - 1)) == 0, "ring size must be a power of two"); \
+    static uint8_t name##_storage[size];                                     \
+    static struct ring name = RING_INIT(name##_storage)
+
+static inline uint32_t ring_count(const struct ring *r) {
+    return r->head - r->tail;
+}
+
+static inline int ring_empty(const struct ring *r) {
+    return r->head == r->tail;
+}
+
+// Producer side
+// @return 0, or -1 if the ring is full and the byte was dropped
+static inline int ring_push(struct ring *r, uint8_t c) {
+    uint32_t head = r->head;
+    if (head - r->tail > r->mask) {
+        r->dropped++;
+        return -1;
+    }
+    r->buf[head & r->mask] = c;
+    // Publish the byte before the index that makes it visible
+    __sync_synchronize();
+    r->head = head + 1;
+    return 0;
+}
+
+// Consumer side
+// @return 0 with the oldest byte in *c, or -1 if the ring is empty
+static inline int ring_pop(struct ring *r, uint8_t *c) {
+    uint32_t tail = r->tail;
+    if (tail == r->head) {
+        return -1;
+    }
+    __sync_synchronize();
+    *c = r->buf[tail & r->mask];
+    // Done with the slot before the producer may reuse it
+    __sync_synchronize();
+    r->tail = tail + 1;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,519 @@
+#include "sched.h"
+#include "timer.h"
+#include "page.h"
+#include "heap.h"
+#include "cpu.h"
+#include "smp.h"
+#include <stddef.h>
+
+extern void switch_to(uint32_t *old_esp, uint32_t new_esp);
+
+// Per-CPU scheduler state. The lock covers the run queues and is held
+// across switch_to, so a thread that is switching out cannot be started
+// on another CPU before its registers are saved.
+struct runqueue {
+    spinlock_t lock;
+    struct thread *current;
+    struct thread *idle;
+    struct thread *prev;                // switched away from, until finish_switch
+    struct thread *head[SCHED_PRIOS];
+    struct thread *tail[SCHED_PRIOS];
+    volatile uint32_t nr_ready;
+    volatile int need_resched;
+    struct thread *zombies;             // exited here, stacks not yet freed
+    struct timer slice_timer;
+    int slice_armed;
+    uint32_t switches;
+    uint32_t preemptions;
+    uint32_t steals;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct runqueue rqs[MAX_CPUS];
+static struct kmem_cache *thread_cache;
+static spinlock_t threads_lock = SPINLOCK_INIT;     // all_threads, next_id, nr_threads
+static struct thread *all_threads;
+static uint32_t next_id;
+static uint32_t nr_threads;
+
+// Interrupts must be off for this to stay our CPU
+static inline struct runqueue *this_rq(void) {
+    return &rqs[cpu_id()];
+}
+
+static void run_enqueue(struct runqueue *rq, struct thread *t) {
+    t->state = THREAD_READY;
+    t->next = NULL;
+    if (rq->tail[t->priority] != NULL) {
+        rq->tail[t->priority]->next = t;
+    } else {
+        rq->head[t->priority] = t;
+    }
+    rq->tail[t->priority] = t;
+    rq->nr_ready++;
+}
+
+// Highest priority first. A thief skips threads that were woken while
+// still switching out on their own CPU.
+static struct thread *run_dequeue(struct runqueue *rq, int stealing) {
+    struct thread **link;
+    struct thread *before;
+    struct thread *t;
+    int p;
+    for (p = 0; p < SCHED_PRIOS; p++) {
+        before = NULL;
+        for (link = &rq->head[p]; (t = *link) != NULL; link = &t->next) {
+            if (stealing && t->on_cpu) {
+                before = t;
+                continue;
+            }
+            *link = t->next;
+            if (rq->tail[p] == t) {
+                rq->tail[p] = before;
+            }
+            t->next = NULL;
+            rq->nr_ready--;
+            return t;
+        }
+    }
+    return NULL;
+}
+
+static void slice_expired(void *arg) {
+    struct runqueue *rq = arg;
+    spin_lock(&rq->lock);
+    rq->slice_armed = 0;
+    rq->need_resched = 1;
+    rq->preemptions++;
+    spin_unlock(&rq->lock);
+    if (rq != this_rq()) {
+        smp_send_resched(rq - rqs);
+    }
+}
+
+// A slice only needs to end if another thread is waiting for this CPU,
+// so a lone busy thread or an idle CPU takes no timer interrupts. The
+// cancel covers a callback that popped the timer but has not run yet.
+// rq->lock held.
+static void slice_arm(struct runqueue *rq) {
+    if (!rq->slice_armed && rq->current != rq->idle && rq->nr_ready > 0) {
+        timer_cancel(&rq->slice_timer);
+        timer_add(&rq->slice_timer, clock_ns() + (uint64_t)SCHED_SLICE_MS * 1000000,
+                  slice_expired, rq);
+        rq->slice_armed = 1;
+    }
+}
+
+// Someone just queued work on busy CPU from: wake an idle CPU to steal it
+static void kick_idle(struct runqueue *from) {
+    unsigned int c;
+    for (c = 0; c < num_cpus; c++) {
+        if (&rqs[c] != from && cpus[c].online && rqs[c].current == rqs[c].idle &&
+            rqs[c].nr_ready == 0) {
+            rqs[c].need_resched = 1;
+            smp_send_resched(c);
+            return;
+        }
+    }
+}
+
+// Queue t on the CPU it last ran on and decide who should run it
+static void make_ready(struct thread *t) {
+    struct runqueue *rq = &rqs[t->cpu];
+    int preempt = 0;
+    spin_lock(&rq->lock);
+    run_enqueue(rq, t);
+    if (rq->current == rq->idle || t->priority < rq->current->priority) {
+        rq->need_resched = 1;
+        preempt = 1;
+    } else {
+        slice_arm(rq);
+    }
+    spin_unlock(&rq->lock);
+    if (!preempt) {
+        kick_idle(rq);
+    } else if (rq != this_rq()) {
+        smp_send_resched(t->cpu);
+    }
+}
+
+// Take a ready thread from another CPU. Only trylock: two CPUs stealing
+// from each other would otherwise deadlock. rq->lock held.
+static struct thread *steal(struct runqueue *rq) {
+    unsigned int self = rq - rqs;
+    unsigned int i;
+    unsigned int c;
+    struct runqueue *victim;
+    struct thread *t;
+    for (i = 1; i < num_cpus; i++) {
+        c = (self + i) % num_cpus;
+        victim = &rqs[c];
+        if (!cpus[c].online || victim->nr_ready == 0 || !spin_trylock(&victim->lock)) {
+            continue;
+        }
+        t = run_dequeue(victim, 1);
+        spin_unlock(&victim->lock);
+        if (t != NULL) {
+            rq->steals++;
+            return t;
+        }
+    }
+    return NULL;
+}
+
+static void reap(struct thread *t) {
+    struct thread *next;
+    for (; t != NULL; t = next) {
+        next = t->next;
+        free_page_block(t->stack);
+        kmem_cache_free(thread_cache, t);
+    }
+}
+
+// Runs on the new thread right after switch_to, still holding the lock
+// of the CPU that switched to it
+static void finish_switch(void) {
+    struct runqueue *rq = this_rq();
+    struct thread *dead = rq->zombies;
+    rq->zombies = NULL;
+    rq->prev->on_cpu = 0;
+    spin_unlock(&rq->lock);
+    reap(dead);
+}
+
+// Interrupts off
+static void schedule(void) {
+    struct runqueue *rq = this_rq();
+    struct thread *prev;
+    struct thread *next;
+
+    spin_lock(&rq->lock);
+    prev = rq->current;
+    rq->need_resched = 0;
+    if (prev->state == THREAD_RUNNING && prev != rq->idle) {
+        run_enqueue(rq, prev);
+    }
+    next = run_dequeue(rq, 0);
+    if (next == NULL) {
+        next = steal(rq);
+    }
+    if (next == NULL) {
+        next = rq->idle;
+    }
+    if (rq->slice_armed) {
+        timer_cancel(&rq->slice_timer);
+        rq->slice_armed = 0;
+    }
+    next->state = THREAD_RUNNING;
+    next->cpu = rq - rqs;
+    next->on_cpu = 1;
+    rq->current = next;
+    slice_arm(rq);
+    if (next == prev) {
+        spin_unlock(&rq->lock);
+        return;
+    }
+    if (prev->state == THREAD_DEAD) {
+        prev->next = rq->zombies;
+        rq->zombies = prev;
+    }
+    rq->switches++;
+    rq->prev = prev;
+    switch_to(&prev->esp, next->esp);
+    finish_switch();
+}
+
+// Switch now if a wakeup asked for it and the caller can be preempted
+static void preempt_check(uint32_t flags) {
+    struct runqueue *rq = this_rq();
+    if ((flags & 0x200) && rq->need_resched && rq->current != NULL) {
+        schedule();
+    }
+}
+
+// First code a new thread runs, returned into from switch_to
+static void thread_start(void) {
+    struct thread *t;
+    finish_switch();
+    t = current_thread();
+    asm volatile("sti");
+    t->fn(t->arg);
+    thread_exit();
+}
+
+static void idle_init(struct ppage *stack) {
+    struct runqueue *rq = this_rq();
+    struct thread *t = kmem_cache_alloc(thread_cache);
+    uint32_t flags;
+    if (t == NULL) {
+        return;
+    }
+    t->next = NULL;
+    t->state = THREAD_RUNNING;
+    t->priority = SCHED_PRIO_IDLE;
+    t->cpu = rq - rqs;
+    t->on_cpu = 1;
+    t->name[0] = 'i';
+    t->name[1] = 'd';
+    t->name[2] = 'l';
+    t->name[3] = 'e';
+    t->name[4] = '\0';
+    t->stack = stack;
+    t->fn = NULL;
+    t->arg = NULL;
+    flags = spin_lock_irqsave(&threads_lock);
+    t->id = next_id++;
+    t->all_next = all_threads;
+    all_threads = t;
+    nr_threads++;
+    spin_unlock_irqrestore(&threads_lock, flags);
+    rq->idle = t;
+    rq->current = t;
+}
+
+void sched_init(void) {
+    if (thread_cache == NULL) {
+        thread_cache = kmem_cache_create("thread", sizeof(struct thread));
+    }
+    if (thread_cache != NULL) {
+        idle_init(NULL);
+    }
+}
+
+void sched_init_ap(struct ppage *stack) {
+    if (thread_cache != NULL) {
+        idle_init(stack);
+    }
+}
+
+void sched_idle(void) {
+    struct runqueue *rq;
+    for (;;) {
+        asm volatile("cli");
+        rq = this_rq();
+        while (rq->need_resched || rq->nr_ready > 0) {
+            schedule();
+        }
+        // sti;hlt is atomic: a wakeup cannot slip in before the halt
+        asm volatile("sti\n"
+                     "hlt" : : : "memory");
+    }
+}
+
+// An online CPU with nothing to do, else this one
+static unsigned int pick_cpu(void) {
+    unsigned int c;
+    for (c = 0; c < num_cpus; c++) {
+        if (cpus[c].online && rqs[c].idle != NULL && rqs[c].current == rqs[c].idle &&
+            rqs[c].nr_ready == 0) {
+            return c;
+        }
+    }
+    return cpu_id();
+}
+
+struct thread *thread_create(const char *name, int priority, thread_fn fn, void *arg) {
+    struct thread *t;
+    uint32_t *sp;
+    uint32_t flags;
+    int i;
+
+    if (thread_cache == NULL || priority < 0 || priority >= SCHED_PRIO_IDLE) {
+        return NULL;
+    }
+    t = kmem_cache_alloc(thread_cache);
+    if (t == NULL) {
+        return NULL;
+    }
+    t->stack = allocate_page_block(THREAD_STACK_ORDER);
+    if (t->stack == NULL) {
+        kmem_cache_free(thread_cache, t);
+        return NULL;
+    }
+    // Frame popped by switch_to: edi, esi, ebx, ebp, then the return
+    // into thread_start, which itself never returns
+    sp = (uint32_t*)((uint8_t*)t->stack->physical_addr + (PAGE_SIZE << THREAD_STACK_ORDER));
+    *--sp = 0;
+    *--sp = (uint32_t)thread_start;
+    for (i = 0; i < 4; i++) {
+        *--sp = 0;
+    }
+    t->esp = (uint32_t)sp;
+    for (i = 0; i < THREAD_NAME_LEN - 1 && name[i] != '\0'; i++) {
+        t->name[i] = name[i];
+    }
+    t->name[i] = '\0';
+    t->priority = priority;
+    t->on_cpu = 0;
+    t->fn = fn;
+    t->arg = arg;
+
+    flags = spin_lock_irqsave(&threads_lock);
+    t->id = next_id++;
+    t->all_next = all_threads;
+    all_threads = t;
+    nr_threads++;
+    spin_unlock(&threads_lock);
+    t->cpu = pick_cpu();
+    make_ready(t);
+    preempt_check(flags);
+    irq_restore(flags);
+    return t;
+}
+
+void thread_exit(void) {
+    struct thread *self;
+    struct thread **link;
+    spin_lock_irqsave(&threads_lock);
+    self = this_rq()->current;
+    for (link = &all_threads; *link != NULL; link = &(*link)->all_next) {
+        if (*link == self) {
+            *link = self->all_next;
+            break;
+        }
+    }
+    nr_threads--;
+    spin_unlock(&threads_lock);
+    self->state = THREAD_DEAD;
+    schedule();
+    for (;;) {}     // not reached: nothing switches back to a dead thread
+}
+
+struct thread *current_thread(void) {
+    uint32_t flags = irq_save();
+    struct thread *t = this_rq()->current;
+    irq_restore(flags);
+    return t;
+}
+
+void sched_yield(void) {
+    uint32_t flags = irq_save();
+    if (this_rq()->current != NULL) {
+        schedule();
+    }
+    irq_restore(flags);
+}
+
+void sched_preempt(void) {
+    struct runqueue *rq = this_rq();
+    if (rq->need_resched && rq->current != NULL) {
+        schedule();
+    }
+}
+
+int sched_can_sleep(void) {
+    struct runqueue *rq = this_rq();
+    return rq->current != NULL && rq->current != rq->idle;
+}
+
+void sleep_on(struct wait_queue *wq) {
+    struct thread *self = this_rq()->current;
+    self->state = THREAD_BLOCKED;
+    self->next = wq->head;
+    wq->head = self;
+    spin_unlock(&wq->lock);
+    // A waker may make us ready before schedule() takes the run queue
+    // lock; schedule() then finds us READY and leaves us queued
+    schedule();
+    spin_lock(&wq->lock);
+}
+
+static void wake_all(struct wait_queue *wq) {
+    struct thread *t;
+    while ((t = wq->head) != NULL) {
+        wq->head = t->next;
+        make_ready(t);
+    }
+}
+
+void wake_up(struct wait_queue *wq) {
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    wake_all(wq);
+    spin_unlock(&wq->lock);
+    preempt_check(flags);
+    irq_restore(flags);
+}
+
+void complete(struct completion *c) {
+    uint32_t flags = spin_lock_irqsave(&c->wq.lock);
+    c->done = 1;
+    wake_all(&c->wq);
+    spin_unlock(&c->wq.lock);
+    preempt_check(flags);
+    irq_restore(flags);
+}
+
+void wait_for_completion(struct completion *c) {
+    uint32_t flags = spin_lock_irqsave(&c->wq.lock);
+    while (!c->done) {
+        if ((flags & 0x200) && sched_can_sleep()) {
+            sleep_on(&c->wq);
+            continue;
+        }
+        spin_unlock(&c->wq.lock);
+        if (flags & 0x200) {
+            // sti;hlt is atomic with respect to the wakeup
+            asm volatile("sti\n"
+                         "hlt\n"
+                         "cli" : : : "memory");
+        } else {
+            asm volatile("pause");
+        }
+        spin_lock(&c->wq.lock);
+    }
+    spin_unlock_irqrestore(&c->wq.lock, flags);
+}
+
+void mutex_lock(struct mutex *m) {
+    uint32_t flags = spin_lock_irqsave(&m->wq.lock);
+    while (m->locked) {
+        if ((flags & 0x200) && sched_can_sleep()) {
+            sleep_on(&m->wq);
+            continue;
+        }
+        spin_unlock(&m->wq.lock);
+        if (flags & 0x200) {
+            // The holder unlocks from a thread, not an IRQ, so this
+            // waits for the next tick at worst
+            asm volatile("sti\n"
+                         "hlt\n"
+                         "cli" : : : "memory");
+        } else {
+            asm volatile("pause");
+        }
+        spin_lock(&m->wq.lock);
+    }
+    m->locked = 1;
+    spin_unlock_irqrestore(&m->wq.lock, flags);
+}
+
+void mutex_unlock(struct mutex *m) {
+    uint32_t flags = spin_lock_irqsave(&m->wq.lock);
+    m->locked = 0;
+    // Waiters retry, so waking them all is enough
+    wake_all(&m->wq);
+    spin_unlock(&m->wq.lock);
+    preempt_check(flags);
+    irq_restore(flags);
+}
+
+void sched_for_each(void (*f)(struct thread *t)) {
+    struct thread *t;
+    uint32_t flags = spin_lock_irqsave(&threads_lock);
+    for (t = all_threads; t != NULL; t = t->all_next) {
+        f(t);
+    }
+    spin_unlock_irqrestore(&threads_lock, flags);
+}
+
+void get_sched_stats(struct sched_stats *out) {
+    unsigned int c;
+    out->threads = nr_threads;
+    out->switches = 0;
+    out->preemptions = 0;
+    out->steals = 0;
+    for (c = 0; c < MAX_CPUS; c++) {
+        out->switches += rqs[c].switches;
+        out->preemptions += rqs[c].preemptions;
+        out->steals += rqs[c].steals;
+    }
+}
@@ -0,0 +1,116 @@
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+#include <stdint.h>
+#include "spinlock.h"
+
+// Strict priorities, round robin within a level. 0 is the highest.
+#define SCHED_PRIOS       4
+#define SCHED_PRIO_HIGH   0
+#define SCHED_PRIO_NORMAL 1
+#define SCHED_PRIO_LOW    2
+#define SCHED_PRIO_IDLE   (SCHED_PRIOS - 1)
+
+#define SCHED_SLICE_MS     10
+#define THREAD_STACK_ORDER 1    // 8 KiB stacks from the page allocator
+#define THREAD_NAME_LEN    16
+
+enum thread_state {
+    THREAD_RUNNING,
+    THREAD_READY,
+    THREAD_BLOCKED,
+    THREAD_DEAD,
+};
+
+typedef void (*thread_fn)(void *arg);
+
+struct ppage;
+
+struct thread {
+    uint32_t esp;               // saved while switched out; switch.s uses offset 0
+    struct thread *next;        // run queue or wait queue
+    struct thread *all_next;    // every live thread
+    uint32_t id;
+    enum thread_state state;
+    int priority;
+    unsigned int cpu;           // run queue it is on, or last ran from
+    volatile int on_cpu;        // still on a CPU, if only to switch out
+    char name[THREAD_NAME_LEN];
+    struct ppage *stack;        // NULL for the boot thread
+    thread_fn fn;
+    void *arg;
+};
+
+struct wait_queue {
+    spinlock_t lock;
+    struct thread *head;
+};
+
+#define WAIT_QUEUE_INIT { SPINLOCK_INIT, 0 }
+
+// A one-shot event: complete() may run on any CPU or in an interrupt
+// handler, and the waiter may return and free it as soon as it sees it
+struct completion {
+    struct wait_queue wq;
+    volatile int done;
+};
+
+#define COMPLETION_INIT { WAIT_QUEUE_INIT, 0 }
+
+// A sleeping lock for long critical sections that do I/O. Not
+// recursive, and not for interrupt handlers.
+struct mutex {
+    struct wait_queue wq;
+    volatile int locked;
+};
+
+#define MUTEX_INIT { WAIT_QUEUE_INIT, 0 }
+
+struct sched_stats {
+    uint32_t threads;
+    uint32_t switches;
+    uint32_t preemptions;       // slices that ran out with others waiting
+    uint32_t steals;            // threads an idle CPU took from another's queue
+};
+
+// Turn the boot context into CPU 0's idle thread. Needs the heap and timer.
+void sched_init(void);
+// Same for an AP, whose boot stack is the given block
+void sched_init_ap(struct ppage *stack);
+// Never returns: run other threads, halting while none is ready
+void sched_idle(void) __attribute__((noreturn));
+
+// Queue a new thread on an idle CPU if there is one, else on this one
+// @return the new thread, or NULL if out of memory
+struct thread *thread_create(const char *name, int priority, thread_fn fn, void *arg);
+void thread_exit(void) __attribute__((noreturn));
+struct thread *current_thread(void);
+
+void sched_yield(void);
+// Called on the way out of an interrupt handler, after the EOI
+void sched_preempt(void);
+
+// True on a thread that may block: not an idle thread, not before
+// sched_init. Callers also need interrupts enabled.
+int sched_can_sleep(void);
+
+// Block on wq until wake_up(). Call with interrupts off and wq->lock
+// held, after checking the condition under it; the lock is dropped
+// while asleep and held again on return.
+void sleep_on(struct wait_queue *wq);
+// Make every thread on wq ready. Set the condition first.
+void wake_up(struct wait_queue *wq);
+
+void complete(struct completion *c);
+// Sleeps when it can, else halts (or spins with interrupts off)
+void wait_for_completion(struct completion *c);
+
+// Sleeps while another thread holds m when it can, else halts (or
+// spins with interrupts off) like wait_for_completion
+void mutex_lock(struct mutex *m);
+void mutex_unlock(struct mutex *m);
+
+void sched_for_each(void (*f)(struct thread *t));
+void get_sched_stats(struct sched_stats *out);
+
+#endif
@@ -0,0 +1,82 @@
+#include "serial.h"
+#include "interrupt.h"
+#include "ring.h"
+#include "sched.h"
+#include <stddef.h>
+
+#define SERIAL_RX_RING_SIZE 256
+
+RING_DEFINE(rx_ring, SERIAL_RX_RING_SIZE);
+static struct wait_queue *rx_wq;
+static int present;
+
+int serial_init(void) {
+    uint16_t divisor = 115200 / SERIAL_BAUD;
+
+    outb(COM1_BASE + UART_IER, 0);
+    outb(COM1_BASE + UART_LCR, UART_LCR_DLAB);
+    outb(COM1_BASE + UART_DATA, divisor & 0xFF);
+    outb(COM1_BASE + UART_IER, divisor >> 8);
+    outb(COM1_BASE + UART_LCR, UART_LCR_8N1);
+    outb(COM1_BASE + UART_IIR, UART_FCR_ENABLE);
+
+    // A byte sent in loopback mode has to come straight back
+    outb(COM1_BASE + UART_MCR, UART_MCR_LOOPBACK);
+    outb(COM1_BASE + UART_DATA, 0xAE);
+    if (inb(COM1_BASE + UART_DATA) != 0xAE) {
+        return -1;
+    }
+    outb(COM1_BASE + UART_MCR, UART_MCR_DTR_RTS_OUT2);
+    present = 1;
+
+    outb(COM1_BASE + UART_IER, UART_IER_RX);
+    IRQ_clear_mask(COM1_IRQ);
+    return 0;
+}
+
+int serial_present(void) {
+    return present;
+}
+
+void serial_putc(char c) {
+    if (!present) {
+        return;
+    }
+    while (!(inb(COM1_BASE + UART_LSR) & UART_LSR_THRE)) {
+        asm volatile("pause");
+    }
+    outb(COM1_BASE + UART_DATA, (uint8_t)c);
+}
+
+// Drain the FIFO into the ring; reading RBR until it is empty also
+// clears the interrupt
+void serial_irq(void) {
+    int got = 0;
+    while (inb(COM1_BASE + UART_LSR) & UART_LSR_DR) {
+        ring_push(&rx_ring, inb(COM1_BASE + UART_DATA));
+        got = 1;
+    }
+    if (got && rx_wq != NULL) {
+        wake_up(rx_wq);
+    }
+}
+
+void serial_rx_notify(struct wait_queue *wq) {
+    rx_wq = wq;
+}
+
+int serial_getc(void) {
+    uint8_t c;
+    if (ring_pop(&rx_ring, &c) != 0) {
+        return -1;
+    }
+    return c;
+}
+
+int serial_rx_pending(void) {
+    return !ring_empty(&rx_ring);
+}
+
+uint32_t serial_rx_dropped(void) {
+    return rx_ring.dropped;
+}
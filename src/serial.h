@@ -0,0 +1,48 @@
+#ifndef __SERIAL_H__
+#define __SERIAL_H__
+
+#include <stdint.h>
+
+#define COM1_BASE 0x3F8
+#define COM1_IRQ  4
+#define SERIAL_BAUD 115200
+
+// 16550 registers, as offsets from the base port
+#define UART_DATA 0     // RBR/THR, or the divisor low byte with DLAB
+#define UART_IER  1     // or the divisor high byte with DLAB
+#define UART_IIR  2     // FCR when written
+#define UART_LCR  3
+#define UART_MCR  4
+#define UART_LSR  5
+
+#define UART_IER_RX    0x01
+#define UART_LCR_8N1   0x03
+#define UART_LCR_DLAB  0x80
+#define UART_FCR_ENABLE 0xC7        // enable and clear FIFOs, 14 byte trigger
+#define UART_MCR_DTR_RTS_OUT2 0x0B  // OUT2 gates the IRQ line
+#define UART_MCR_LOOPBACK 0x1E
+#define UART_LSR_DR    0x01
+#define UART_LSR_THRE  0x20
+
+struct wait_queue;
+
+// Program COM1 for SERIAL_BAUD 8N1 with receive interrupts on IRQ4.
+// Call after apic_init(), so the unmask reaches whichever controller
+// delivers ISA IRQs.
+// @return 0, or -1 if no UART answers the loopback test
+int serial_init(void);
+int serial_present(void);
+
+// Polled transmit; a no-op without a UART
+void serial_putc(char c);
+
+// Receive side: the IRQ handler fills a ring that one consumer drains.
+// wq, if set, is woken whenever new bytes arrive.
+void serial_irq(void);
+void serial_rx_notify(struct wait_queue *wq);
+// @return the next received byte, or -1 if none is waiting
+int serial_getc(void);
+int serial_rx_pending(void);
+uint32_t serial_rx_dropped(void);
+
+#endif
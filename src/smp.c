@@ -0,0 +1,140 @@
+#include "smp.h"
+#include "apic.h"
+#include "cpu.h"
+#include "page.h"
+#include "paging.h"
+#include "spinlock.h"
+#include "sched.h"
+#include "timer.h"
+#include <stddef.h>
+
+#define AP_START_TIMEOUT_MS 100
+
+struct cpu_info cpus[MAX_CPUS] = { { 0, 1 } };
+unsigned int num_cpus = 1;
+
+extern char trampoline_start[];
+extern char trampoline_end[];
+
+// Handed to the AP being started, read by trampoline.s
+uint32_t smp_boot_cr0;
+uint32_t smp_boot_cr3;
+uint32_t smp_boot_cr4;
+uint32_t smp_boot_stack;
+static struct ppage *smp_boot_block;
+
+// One shootdown at a time; the CPUs it still waits for
+static spinlock_t tlb_lock = SPINLOCK_INIT;
+static volatile uint32_t tlb_pending;
+
+void ap_main(void);
+
+// First C code on an AP, on the stack smp_init() gave it
+void ap_main(void) {
+    unsigned int cpu;
+    lapic_init();
+    cpu = cpu_id();
+    sched_init_ap(smp_boot_block);
+    cpus[cpu].online = 1;
+    sched_idle();
+}
+
+static int start_ap(unsigned int cpu) {
+    uint32_t deadline;
+    int tries;
+
+    smp_boot_block = allocate_page_block(THREAD_STACK_ORDER);
+    if (smp_boot_block == NULL) {
+        return -1;
+    }
+    smp_boot_stack = (uint32_t)smp_boot_block->physical_addr + (PAGE_SIZE << THREAD_STACK_ORDER);
+
+    // INIT, then up to two STARTUPs pointing at the trampoline page
+    lapic_send_ipi(cpus[cpu].apic_id, ICR_INIT | ICR_ASSERT);
+    delay(10);
+    for (tries = 0; tries < 2 && !cpus[cpu].online; tries++) {
+        lapic_send_ipi(cpus[cpu].apic_id, ICR_STARTUP | ICR_ASSERT | (TRAMPOLINE_BASE >> 12));
+        deadline = clock_ms() + (tries == 0 ? 1 : AP_START_TIMEOUT_MS);
+        while (!cpus[cpu].online && (int32_t)(clock_ms() - deadline) < 0) {
+            asm volatile("pause");
+        }
+    }
+    if (!cpus[cpu].online) {
+        // A CPU that never came up can keep its stack: it may still be
+        // running the trampoline
+        return -1;
+    }
+    return 0;
+}
+
+unsigned int smp_init(void) {
+    unsigned int online = 1;
+    unsigned int cpu;
+    char *dst = (char*)TRAMPOLINE_BASE;
+    char *src;
+
+    if (lapic == NULL || num_cpus < 2) {
+        return online;
+    }
+    for (src = trampoline_start; src < trampoline_end; src++) {
+        *dst++ = *src;
+    }
+    asm volatile("mov %%cr0, %0" : "=r"(smp_boot_cr0));
+    asm volatile("mov %%cr3, %0" : "=r"(smp_boot_cr3));
+    asm volatile("mov %%cr4, %0" : "=r"(smp_boot_cr4));
+    for (cpu = 1; cpu < num_cpus; cpu++) {
+        if (start_ap(cpu) == 0) {
+            online++;
+        }
+    }
+    return online;
+}
+
+void smp_send_resched(unsigned int cpu) {
+    if (lapic != NULL && cpu < num_cpus && cpus[cpu].online) {
+        lapic_send_ipi(cpus[cpu].apic_id, ICR_FIXED | ICR_ASSERT | RESCHED_VECTOR);
+    }
+}
+
+void smp_tlb_ack(void) {
+    uint32_t bit = 1u << cpu_id();
+    if (tlb_pending & bit) {
+        flush_tlb();
+        __sync_fetch_and_and(&tlb_pending, ~bit);
+    }
+}
+
+void smp_flush_tlb_all(void) {
+    uint32_t flags = irq_save();
+    unsigned int self = cpu_id();
+    unsigned int cpu;
+    uint32_t mask = 0;
+
+    flush_tlb();
+    if (lapic == NULL || num_cpus < 2) {
+        irq_restore(flags);
+        return;
+    }
+    // Another CPU's shootdown may be waiting on us, and with interrupts
+    // off its IPI cannot get in: answer it by hand
+    while (!spin_trylock(&tlb_lock)) {
+        smp_tlb_ack();
+        asm volatile("pause");
+    }
+    for (cpu = 0; cpu < num_cpus; cpu++) {
+        if (cpu != self && cpus[cpu].online) {
+            mask |= 1u << cpu;
+        }
+    }
+    tlb_pending = mask;
+    for (cpu = 0; cpu < num_cpus; cpu++) {
+        if (mask & (1u << cpu)) {
+            lapic_send_ipi(cpus[cpu].apic_id, ICR_FIXED | ICR_ASSERT | TLB_VECTOR);
+        }
+    }
+    while (tlb_pending) {
+        asm volatile("pause");
+    }
+    spin_unlock(&tlb_lock);
+    irq_restore(flags);
+}
@@ -0,0 +1,25 @@
+#ifndef __SMP_H__
+#define __SMP_H__
+
+#include <stdint.h>
+
+// Real-mode page the APs start in. Low memory is never handed out by
+// the page allocator, so it is free once the BIOS is done with it.
+#define TRAMPOLINE_BASE 0x8000
+
+// Start every AP that apic_init() found with INIT-SIPI-SIPI, one at a
+// time. Needs the scheduler and interrupts on (for delay()).
+// @return the number of CPUs online, the boot CPU included
+unsigned int smp_init(void);
+
+// Interrupt another CPU so it runs the scheduler
+void smp_send_resched(unsigned int cpu);
+
+// Flush the TLB of every online CPU and wait until they all have, so a
+// frame that was unmapped can be reused. Do not call it holding a lock
+// another CPU may spin on with interrupts off.
+void smp_flush_tlb_all(void);
+// TLB_VECTOR handler: flush if asked to
+void smp_tlb_ack(void);
+
+#endif
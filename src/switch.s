@@ -0,0 +1,30 @@
+.intel_syntax noprefix
+
+# Kernel thread context switch
+# C prototype:
+#   void switch_to(uint32_t *old_esp, uint32_t new_esp);
+#
+# Pushes the callee-saved registers on the current stack, stores the
+# stack pointer in *old_esp and picks up the thread whose stack pointer
+# is new_esp. Everything else is caller-saved, so this is the whole
+# context. A new thread's stack is built to look like it was switched
+# out here, with thread_start as the return address.
+
+.globl switch_to
+.type switch_to, @function
+switch_to:
+    mov  eax, [esp + 4]    # old_esp
+    mov  edx, [esp + 8]    # new_esp
+
+    push ebp
+    push ebx
+    push esi
+    push edi
+    mov  [eax], esp
+
+    mov  esp, edx
+    pop  edi
+    pop  esi
+    pop  ebx
+    pop  ebp
+    ret
@@ -26,37 +26,85 @@ void print_page_list(const char *name, struct ppage *list) {
     }
 }
 
+void print_free_count(const char *name) {
+    esp_printf(putc, "%s: %d pages\r\n", name, get_free_page_count());
+}
+
+int is_contiguous(struct ppage *list) {
+    struct ppage *current = list;
+    while (current != NULL && current->next != NULL) {
+        if (current->next != current + 1) {
+            return 0;
+        }
+        current = current->next;
+    }
+    return 1;
+}
+
+int largest_free_block(void) {
+    int order;
+    for (order = PAGE_MAX_ORDER - 1; order >= 0; order--) {
+        if (get_free_list(order) != NULL) {
+            return 1 << order;
+        }
+    }
+    return 0;
+}
+
+// Exercise the allocator right after init_pfa_list; run when
+// CONFIG_TEST_PAGE is set. Leaves every frame free again when done.
 void test_page_allocator(void) {
     struct ppage *allocated1 = NULL;
     struct ppage *allocated2 = NULL;
     struct ppage *allocated3 = NULL;
     esp_printf(putc, "\r\n=== Page Frame Allocator Tests ===\r\n\r\n");
-    esp_printf(putc, "Test 1: Initializing...\r\n");
-    init_pfa_list();
-    print_page_list("Free pages after init", get_free_list());
+    esp_printf(putc, "Test 1: Initial state...\r\n");
+    print_free_count("Free pages after init");
     esp_printf(putc, "\r\nTest 2: Allocating 1 page...\r\n");
     allocated1 = allocate_physical_pages(1);
     print_page_list("Allocated", allocated1);
-    print_page_list("Free remaining", get_free_list());
+    print_free_count("Free remaining");
     esp_printf(putc, "\r\nTest 3: Allocating 5 pages...\r\n");
     allocated2 = allocate_physical_pages(5);
     print_page_list("Allocated", allocated2);
-    print_page_list("Free remaining", get_free_list());
+    print_free_count("Free remaining");
     esp_printf(putc, "\r\nTest 4: Allocating 10 pages...\r\n");
     allocated3 = allocate_physical_pages(10);
     print_page_list("Allocated", allocated3);
-    print_page_list("Free remaining", get_free_list());
+    print_free_count("Free remaining");
     esp_printf(putc, "\r\nTest 5: Freeing 1 page...\r\n");
     free_physical_pages(allocated1);
     allocated1 = NULL;
-    print_page_list("Free after freeing 1", get_free_list());
+    print_free_count("Free after freeing 1");
     esp_printf(putc, "\r\nTest 6: Freeing 5 pages...\r\n");
     free_physical_pages(allocated2);
     allocated2 = NULL;
-    print_page_list("Free after freeing 5", get_free_list());
+    print_free_count("Free after freeing 5");
     esp_printf(putc, "\r\nTest 7: Freeing 10 pages...\r\n");
     free_physical_pages(allocated3);
     allocated3 = NULL;
-    print_page_list("Free after freeing 10", get_free_list());
+    print_free_count("Free after freeing 10");
+    esp_printf(putc, "\r\nTest 8: Contiguity and coalescing...\r\n");
+    allocated1 = allocate_physical_pages(5);
+    esp_printf(putc, "  5-page run contiguous: %s\r\n", is_contiguous(allocated1) ? "yes" : "no");
+    free_physical_pages(allocated1);
+    allocated1 = NULL;
+    esp_printf(putc, "  Largest free block: %d pages\r\n", largest_free_block());
+    print_free_count("Free after coalescing");
+    esp_printf(putc, "\r\nTest 9: Large frames...\r\n");
+    struct pfa_stats stats;
+    get_pfa_stats(&stats);
+    esp_printf(putc, "  Free large frames: %d\r\n", stats.free_large_pages);
+    allocated1 = allocate_large_page();
+    if (allocated1 != NULL) {
+        esp_printf(putc, "  Large frame at 0x%x\r\n", (unsigned int)allocated1->physical_addr);
+    }
+    get_pfa_stats(&stats);
+    esp_printf(putc, "  Free large frames: %d\r\n", stats.free_large_pages);
+    free_large_page(allocated1);
+    allocated1 = NULL;
+    get_pfa_stats(&stats);
+    esp_printf(putc, "  Free large frames after free: %d\r\n", stats.free_large_pages);
+    esp_printf(putc, "  Splits: %d, merges: %d\r\n", stats.large_splits, stats.large_merges);
     esp_printf(putc, "\r\n=== All Tests Complete ===\r\n\r\n");
 }
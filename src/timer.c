@@ -0,0 +1,253 @@
+#include "timer.h"
+#include "interrupt.h"
+#include "spinlock.h"
+#include "cpu.h"
+#include "sched.h"
+#include <stddef.h>
+
+#define CAL_COUNT   11932       // 10 ms of PIT input clocks
+#define CAL_TRIES   3
+#define PIT_RELOAD  (PIT_HZ / TIMER_HZ)
+#define CLOCK_SHIFT 22          // mult is ns per count in 10.22 fixed point
+
+static spinlock_t timer_lock = SPINLOCK_INIT;
+static struct timer *timers;            // pending, sorted by expiry
+static uint32_t khz;
+static uint32_t mult;
+static uint64_t tsc_base;
+static uint64_t pit_counts;             // PIT input clocks seen, without a TSC
+static uint16_t pit_last;               // channel 0 count at the last read
+static uint64_t last_ns;
+static struct timer_stats stats;
+
+// 64/32 division in two divl steps, as there is no libgcc for __udivdi3
+static uint64_t div64_32(uint64_t n, uint32_t d) {
+    uint32_t hi = n >> 32;
+    uint32_t lo = n;
+    uint32_t qhi = hi / d;
+    uint32_t r = hi % d;
+    uint32_t qlo;
+    asm("divl %4" : "=a"(qlo), "=d"(r) : "a"(lo), "d"(r), "rm"(d));
+    return ((uint64_t)qhi << 32) | qlo;
+}
+
+// Split so the 64x32 product cannot overflow
+static uint64_t counts_to_ns(uint64_t counts) {
+    uint32_t hi = counts >> 32;
+    uint32_t lo = counts;
+    return (((uint64_t)hi * mult) << (32 - CLOCK_SHIFT)) +
+           (((uint64_t)lo * mult) >> CLOCK_SHIFT);
+}
+
+static uint16_t pit_read(void) {
+    uint16_t count;
+    outb(PIT_COMMAND, 0x00);    // latch channel 0
+    count = inb(PIT_CHANNEL0);
+    count |= inb(PIT_CHANNEL0) << 8;
+    return count;
+}
+
+// Caller holds timer_lock. Without a TSC the PIT count is folded into
+// pit_counts on every read; the tick interrupt guarantees a read at
+// least once per period, so no wrap is missed.
+static uint64_t clock_read(void) {
+    uint64_t ns;
+    uint16_t count;
+    if (khz != 0) {
+        ns = counts_to_ns(rdtsc() - tsc_base);
+    } else {
+        count = pit_read();
+        pit_counts += count <= pit_last ? pit_last - count : pit_last + PIT_RELOAD - count;
+        pit_last = count;
+        ns = counts_to_ns(pit_counts);
+    }
+    if (ns < last_ns) {
+        ns = last_ns;
+    }
+    last_ns = ns;
+    return ns;
+}
+
+// Arm the one-shot for the earliest timer. Deadlines past the longest
+// PIT count take an extra interrupt to re-arm; with nothing pending the
+// PIT stays quiet. Caller holds timer_lock.
+static void timer_program(uint64_t now) {
+    uint64_t delta;
+    uint32_t counts;
+    if (khz == 0 || timers == NULL) {
+        return;
+    }
+    delta = timers->expires > now ? timers->expires - now : 0;
+    if (delta >= 55000000) {
+        counts = PIT_MAX;
+    } else {
+        counts = div64_32(delta * PIT_HZ, 1000000000);
+        if (counts > PIT_MAX) {
+            counts = PIT_MAX;
+        } else if (counts == 0) {
+            counts = 1;
+        }
+    }
+    outb(PIT_COMMAND, 0x30);    // channel 0, lo/hi, mode 0
+    outb(PIT_CHANNEL0, counts & 0xFF);
+    outb(PIT_CHANNEL0, counts >> 8);
+}
+
+// TSC cycles across CAL_COUNT PIT clocks on channel 2, or 0 if the
+// channel never finished
+static uint32_t tsc_calibrate(void) {
+    uint32_t start;
+    uint32_t loops;
+    outb(PIT_GATE, (inb(PIT_GATE) & ~0x02) | 0x01);    // gate on, speaker off
+    outb(PIT_COMMAND, 0xB0);    // channel 2, lo/hi, mode 0
+    outb(PIT_CHANNEL2, CAL_COUNT & 0xFF);
+    outb(PIT_CHANNEL2, CAL_COUNT >> 8);
+    start = rdtsc();
+    for (loops = 0; (inb(PIT_GATE) & 0x20) == 0; loops++) {
+        if (loops > 1000000) {
+            return 0;
+        }
+    }
+    return (uint32_t)rdtsc() - start;
+}
+
+void timer_init(void) {
+    uint32_t best = 0;
+    uint32_t cycles;
+    int i;
+
+    if (cpu_has_feature(CPUID_FEAT_EDX_TSC)) {
+        // Take the shortest run: an SMI or emulator stall only adds cycles
+        for (i = 0; i < CAL_TRIES; i++) {
+            cycles = tsc_calibrate();
+            if (cycles != 0 && (best == 0 || cycles < best)) {
+                best = cycles;
+            }
+        }
+        khz = div64_32((uint64_t)best * PIT_HZ, CAL_COUNT * 1000);
+    }
+    if (khz >= 1000) {          // mult has to fit in 32 bits
+        mult = div64_32(1000000ULL << CLOCK_SHIFT, khz);
+        tsc_base = rdtsc();
+        outb(PIT_COMMAND, 0x30);    // mode 0 with no count: disarmed
+    } else {
+        khz = 0;
+        mult = div64_32(1000000000ULL << CLOCK_SHIFT, PIT_HZ);
+        outb(PIT_COMMAND, 0x34);    // channel 0, lo/hi, mode 2 rate generator
+        outb(PIT_CHANNEL0, PIT_RELOAD & 0xFF);
+        outb(PIT_CHANNEL0, PIT_RELOAD >> 8);
+        pit_last = PIT_RELOAD;
+    }
+    IRQ_clear_mask(0);
+}
+
+uint64_t clock_ns(void) {
+    uint32_t flags = spin_lock_irqsave(&timer_lock);
+    uint64_t ns = clock_read();
+    spin_unlock_irqrestore(&timer_lock, flags);
+    return ns;
+}
+
+uint32_t clock_ms(void) {
+    return div64_32(clock_ns(), 1000000);
+}
+
+uint32_t tsc_khz(void) {
+    return khz;
+}
+
+int timer_tickless(void) {
+    return khz != 0;
+}
+
+void timer_add(struct timer *t, uint64_t expires, timer_fn fn, void *arg) {
+    struct timer **link;
+    uint32_t flags;
+
+    t->expires = expires;
+    t->fn = fn;
+    t->arg = arg;
+    flags = spin_lock_irqsave(&timer_lock);
+    // Insert after timers with the same deadline so they fire in order
+    link = &timers;
+    while (*link != NULL && (*link)->expires <= expires) {
+        link = &(*link)->next;
+    }
+    t->next = *link;
+    *link = t;
+    if (timers == t) {
+        timer_program(clock_read());
+    }
+    spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+int timer_cancel(struct timer *t) {
+    struct timer **link;
+    int ret = -1;
+    uint32_t flags = spin_lock_irqsave(&timer_lock);
+    for (link = &timers; *link != NULL; link = &(*link)->next) {
+        if (*link == t) {
+            *link = t->next;
+            ret = 0;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&timer_lock, flags);
+    return ret;
+}
+
+// IRQ0: pop what is due one timer at a time and run it without
+// timer_lock, so callbacks can add timers of their own and a timer
+// cancelled from another CPU is never run after timer_cancel() returns
+void timer_irq(void) {
+    struct timer *t;
+    uint64_t now;
+    uint32_t flags = spin_lock_irqsave(&timer_lock);
+
+    stats.irqs++;
+    for (;;) {
+        now = clock_read();
+        t = timers;
+        if (t == NULL || t->expires > now) {
+            break;
+        }
+        timers = t->next;
+        stats.expired++;
+        spin_unlock(&timer_lock);
+        t->fn(t->arg);
+        spin_lock(&timer_lock);
+    }
+    timer_program(now);
+    spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+static void delay_wake(void *arg) {
+    complete(arg);
+}
+
+void delay(uint32_t ms) {
+    struct timer t;
+    struct completion done = COMPLETION_INIT;
+    uint64_t deadline = clock_ns() + (uint64_t)ms * 1000000;
+    uint32_t flags;
+
+    timer_add(&t, deadline, delay_wake, &done);
+    flags = irq_save();
+    if (!(flags & 0x200)) {
+        // Nothing will deliver the interrupt on this CPU, so watch the clock
+        while (clock_ns() < deadline) {
+            asm volatile("pause");
+        }
+        if (timer_cancel(&t) == 0) {
+            irq_restore(flags);
+            return;
+        }
+        // Another CPU popped it: let its callback finish with us first
+    }
+    irq_restore(flags);
+    wait_for_completion(&done);
+}
+
+void get_timer_stats(struct timer_stats *out) {
+    *out = stats;
+}
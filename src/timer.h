@@ -0,0 +1,57 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stdint.h>
+
+#define PIT_HZ       1193182
+#define PIT_CHANNEL0 0x40
+#define PIT_CHANNEL2 0x42
+#define PIT_COMMAND  0x43
+#define PIT_GATE     0x61       // bit 0 gates channel 2, bit 5 is its output
+#define PIT_MAX      0xFFFF     // longest one-shot, about 55 ms
+
+// Tick rate used only when there is no TSC to keep time between interrupts
+#define TIMER_HZ 100
+
+typedef void (*timer_fn)(void *arg);
+
+// A one-shot timer. The caller owns the memory; it must stay valid until
+// the timer fires or is cancelled. fn runs from the timer interrupt.
+struct timer {
+    struct timer *next;
+    uint64_t expires;           // clock_ns() deadline
+    timer_fn fn;
+    void *arg;
+};
+
+struct timer_stats {
+    uint32_t irqs;              // PIT interrupts taken
+    uint32_t expired;           // timers that have fired
+};
+
+// Calibrate the TSC against the PIT and start the clock. With a TSC the
+// PIT runs one-shot and only interrupts when a timer is due; without one
+// it ticks at TIMER_HZ. Call with interrupts off, after init_idt().
+void timer_init(void);
+
+// Nanoseconds since timer_init(). Never goes backwards.
+uint64_t clock_ns(void);
+uint32_t clock_ms(void);
+
+// TSC frequency in kHz, or 0 when the clock is driven by the PIT
+uint32_t tsc_khz(void);
+int timer_tickless(void);
+
+void timer_add(struct timer *t, uint64_t expires, timer_fn fn, void *arg);
+// @return 0 if the timer was pending, -1 if it already fired
+int timer_cancel(struct timer *t);
+
+void timer_irq(void);
+
+// Sleep for ms milliseconds. Blocks the calling thread, halts when there
+// is none, or spins on the clock when interrupts are off.
+void delay(uint32_t ms);
+
+void get_timer_stats(struct timer_stats *out);
+
+#endif
@@ -0,0 +1,79 @@
+.intel_syntax noprefix
+
+# Application processor start-up
+#
+# smp_init() copies trampoline_start..trampoline_end to TRAMPOLINE_BASE
+# and points the STARTUP IPI at it. The AP wakes in real mode there,
+# loads a flat GDT of its own, switches to protected mode and jumps into
+# the kernel proper at ap_entry32. That code turns on paging with the
+# boot CPU's control registers, moves to the kernel's GDT and IDT and
+# calls ap_main() on the stack smp_init() left in smp_boot_stack.
+
+.set TRAMPOLINE_BASE, 0x8000
+.set KERNEL_CS, 0x08
+.set KERNEL_DS, 0x10
+
+.globl trampoline_start
+.globl trampoline_end
+
+.code16
+trampoline_start:
+    cli
+    cld
+    xor  ax, ax
+    mov  ds, ax
+    lgdt [TRAMPOLINE_BASE + tramp_gdt_ptr - trampoline_start]
+    mov  eax, cr0
+    or   eax, 1            # PE
+    mov  cr0, eax
+    # ljmp KERNEL_CS:ap_entry32 with a 32-bit offset
+    .byte 0x66, 0xEA
+    .long ap_entry32
+    .word KERNEL_CS
+
+.align 8
+tramp_gdt:
+    .quad 0
+    .quad 0x00CF9A000000FFFF    # 0x08: code, flat 4 GiB, 32-bit
+    .quad 0x00CF92000000FFFF    # 0x10: data, flat 4 GiB
+tramp_gdt_ptr:
+    .word tramp_gdt_ptr - tramp_gdt - 1
+    .long TRAMPOLINE_BASE + tramp_gdt - trampoline_start
+trampoline_end:
+
+.code32
+.type ap_entry32, @function
+ap_entry32:
+    mov  ax, KERNEL_DS
+    mov  ds, ax
+    mov  es, ax
+    mov  ss, ax
+
+    # Same paging setup as the boot CPU: PSE/PGE first, then CR3, then PG
+    mov  eax, [smp_boot_cr4]
+    mov  cr4, eax
+    mov  eax, [smp_boot_cr3]
+    mov  cr3, eax
+    mov  eax, [smp_boot_cr0]
+    mov  cr0, eax
+
+    lgdt [gdt_desc]
+    push KERNEL_CS
+    push OFFSET ap_reload_cs
+    retf
+ap_reload_cs:
+    mov  ax, KERNEL_DS
+    mov  ds, ax
+    mov  es, ax
+    mov  fs, ax
+    mov  gs, ax
+    mov  ss, ax
+    lidt [idt_ptr]
+
+    mov  esp, [smp_boot_stack]
+    xor  ebp, ebp
+    call ap_main
+.ap_halt:
+    cli
+    hlt
+    jmp  .ap_halt
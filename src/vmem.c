@@ -0,0 +1,147 @@
+#include "vmem.h"
+#include "page.h"
+#include "paging.h"
+#include "heap.h"
+#include "spinlock.h"
+#include "smp.h"
+#include <stddef.h>
+
+// A reserved range of kernel virtual memory. Nothing backs it until a
+// page is first touched; the fault handler then maps a zeroed frame.
+struct vm_region {
+    struct vm_region *next;
+    uint32_t start;
+    uint32_t end;
+};
+
+// Sorted by address; one unmapped guard page is left after each region
+static struct vm_region *regions = NULL;
+static spinlock_t vm_lock = SPINLOCK_INIT;
+static unsigned int resident_pages = 0;
+
+void *vm_reserve(uint32_t size) {
+    struct vm_region *r;
+    struct vm_region **link;
+    uint32_t start = VMEM_START;
+    uint32_t flags;
+
+    if (size == 0 || size > VMEM_END - VMEM_START) {
+        return NULL;
+    }
+    size = (size + PAGE_SIZE - 1) & PAGE_FRAME_MASK;
+    r = kmalloc(sizeof(struct vm_region));
+    if (r == NULL) {
+        return NULL;
+    }
+
+    // First fit between existing regions
+    flags = spin_lock_irqsave(&vm_lock);
+    link = &regions;
+    while (*link != NULL && (*link)->start - start < size + PAGE_SIZE) {
+        start = (*link)->end + PAGE_SIZE;
+        link = &(*link)->next;
+    }
+    if (start > VMEM_END || VMEM_END - start < size) {
+        spin_unlock_irqrestore(&vm_lock, flags);
+        kfree(r);
+        return NULL;
+    }
+    r->start = start;
+    r->end = start + size;
+    r->next = *link;
+    *link = r;
+    spin_unlock_irqrestore(&vm_lock, flags);
+    return (void*)start;
+}
+
+// Unmap a region and give every frame that was faulted in back to the PFA
+void vm_release(void *addr) {
+    struct vm_region *r;
+    struct vm_region **link;
+    struct ppage *frames = NULL;
+    struct ppage *pp;
+    uint32_t va;
+    uint32_t frame;
+    uint32_t flags = spin_lock_irqsave(&vm_lock);
+
+    for (r = regions; r != NULL && r->start != (uint32_t)addr; r = r->next) {
+    }
+    if (r == NULL) {
+        spin_unlock_irqrestore(&vm_lock, flags);
+        return;
+    }
+    for (va = r->start; va < r->end; va += PAGE_SIZE) {
+        frame = unmap_page(va);
+        if (frame != 0) {
+            pp = phys_to_ppage((void*)frame);
+            pp->next = frames;
+            frames = pp;
+            resident_pages--;
+        }
+    }
+    spin_unlock_irqrestore(&vm_lock, flags);
+
+    // Other CPUs may still hold the old translations. The frames and the
+    // address range stay ours until none does.
+    smp_flush_tlb_all();
+
+    flags = spin_lock_irqsave(&vm_lock);
+    for (link = &regions; *link != r; link = &(*link)->next) {
+    }
+    *link = r->next;
+    spin_unlock_irqrestore(&vm_lock, flags);
+    free_physical_pages(frames);
+    kfree(r);
+}
+
+// Called from the page fault handler. Returns 0 if the fault was a first
+// touch of a reserved region and has been satisfied.
+int vm_handle_fault(uint32_t addr, uint32_t error_code) {
+    struct vm_region *r;
+    struct ppage *pp;
+    uint32_t *frame;
+    uint32_t va = addr & PAGE_FRAME_MASK;
+    uint32_t flags;
+    int i;
+
+    if (error_code & PTE_PRESENT) {
+        return -1;      // protection violation, not a missing page
+    }
+    flags = spin_lock_irqsave(&vm_lock);
+    for (r = regions; r != NULL && r->start <= addr; r = r->next) {
+        if (addr < r->end) {
+            break;
+        }
+    }
+    if (r == NULL || addr < r->start) {
+        spin_unlock_irqrestore(&vm_lock, flags);
+        return -1;
+    }
+    // Another CPU faulted on the same page first and has mapped it
+    if (virt_to_phys(va) != 0) {
+        spin_unlock_irqrestore(&vm_lock, flags);
+        return 0;
+    }
+
+    pp = allocate_physical_pages(1);
+    if (pp == NULL) {
+        spin_unlock_irqrestore(&vm_lock, flags);
+        return -1;
+    }
+    frame = (uint32_t*)pp->physical_addr;
+    for (i = 0; i < PAGE_SIZE / 4; i++) {
+        frame[i] = 0;
+    }
+    if (map_page(va, (uint32_t)frame, PTE_WRITABLE) != 0) {
+        free_physical_pages(pp);
+        spin_unlock_irqrestore(&vm_lock, flags);
+        return -1;
+    }
+    resident_pages++;
+    spin_unlock_irqrestore(&vm_lock, flags);
+    return 0;
+}
+
+unsigned int vm_resident_pages(void) {
+    return resident_pages;
+}
@@ -0,0 +1,15 @@
+#ifndef __VMEM_H__
+#define __VMEM_H__
+
+#include <stdint.h>
+
+// Kernel virtual area for lazily backed regions (above the identity map)
+#define VMEM_START 0xD0000000
+#define VMEM_END   0xF0000000
+
+void *vm_reserve(uint32_t size);
+void vm_release(void *addr);
+int vm_handle_fault(uint32_t addr, uint32_t error_code);
+unsigned int vm_resident_pages(void);
+
+#endif